@@ -0,0 +1,538 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include "conn.h"
+
+/*
+ * Connections live in a slab that only grows, CONN_CHUNK at a time, and
+ * are recycled through a lock-free free list, so once the slab is as big
+ * as the busiest moment has needed, accepting and serving a connection
+ * allocates nothing. A connection is known by its slab id, which lets the
+ * list head be one 64-bit word: the id of the first free connection plus
+ * one (0 for none) in the low half and a count of pops in the high half.
+ * The count changes on every pop, so a thread whose view of the head went
+ * stale while others popped and pushed the same connection fails its CAS
+ * instead of installing a dead link (the ABA problem). Slab memory is
+ * never returned, so reading a link another thread has just taken is
+ * harmless.
+ */
+#define CONN_CHUNK_BITS 6
+#define CONN_CHUNK (1 << CONN_CHUNK_BITS)
+#define CONN_MAX_CHUNKS 4096
+
+static conn_t* chunks[CONN_MAX_CHUNKS];
+static int chunk_count = 0;
+static pthread_mutex_t grow_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t free_head = 0;
+
+// what next_decoded returns past the end of a slice or at a bad escape
+#define DECODE_END -1
+#define DECODE_ERROR -2
+
+static conn_t* slab_conn(int id);
+static conn_t* pop_free();
+static void push_free(conn_t* conn);
+static conn_t* grow_slab();
+static void parse_request_line(char* line, int length, request_t* req);
+static void parse_header(char* line, int length, request_t* req);
+static void parse_query(slice_t target, query_t* q);
+static query_param_t* find_param(query_t* q, char* name);
+static int next_int(char** p, char* end, int* value);
+static int decoded_equals(slice_t s, char* str, int plus_is_space);
+static int next_decoded(char** p, char* end, int plus_is_space);
+static int hex_value(char c);
+
+/*
+ * A connection for fd, from the free list if it has one. NULL only if the
+ * slab is at its limit or memory has run out.
+ */
+conn_t* conn_alloc(int fd)
+{
+    conn_t* conn = pop_free();
+
+    if (conn == NULL && (conn = grow_slab()) == NULL)
+        return NULL;
+    conn_init(conn, fd);
+    return conn;
+}
+
+void conn_free(conn_t* conn)
+{
+    push_free(conn);
+}
+
+void conn_init(conn_t* conn, int fd)
+{
+    conn->fd = fd;
+    conn->start = 0;
+    conn->end = 0;
+    conn->scanned = 0;
+    conn->header_end = 0;
+    conn->requests = 0;
+    conn->loop = NULL;
+    conn->prev = NULL;
+    conn->next = NULL;
+    conn->buf[0] = '\0';
+}
+
+/*
+ * Read as much as fits into the free end of the buffer, first moving
+ * unconsumed bytes to the front if that is where the room is. Returns what
+ * read() did, or -1 with errno set to ENOBUFS if there is no room at all.
+ */
+int conn_fill(conn_t* conn)
+{
+    int n;
+
+    if (conn->end == CONN_BUFSIZE && conn->start > 0)
+    {
+        memmove(conn->buf, conn->buf + conn->start, conn->end - conn->start);
+        conn->end -= conn->start;
+        conn->start = 0;
+    }
+    if (conn->end == CONN_BUFSIZE)
+    {
+        errno = ENOBUFS;
+        return -1;
+    }
+
+    do
+    {
+        n = read(conn->fd, conn->buf + conn->end, CONN_BUFSIZE - conn->end);
+    } while (n < 0 && errno == EINTR);
+
+    if (n > 0)
+    {
+        conn->end += n;
+        conn->buf[conn->end] = '\0';
+    }
+    return n;
+}
+
+/*
+ * Look for a complete request at the front of the buffer. Returns 1 and
+ * fills in req once the headers and body have all arrived, 0 if more input
+ * is needed and -1 if the request can never fit in the buffer.
+ */
+int conn_parse(conn_t* conn, request_t* req)
+{
+    char* base;
+    char* eol;
+    int avail;
+
+    // empty lines between requests are allowed
+    if (conn->scanned == 0)
+    {
+        while (conn->start < conn->end &&
+               (conn->buf[conn->start] == '\r' || conn->buf[conn->start] == '\n'))
+            conn->start++;
+    }
+
+    base = conn->buf + conn->start;
+    avail = conn->end - conn->start;
+
+    // memchr does the scanning a word or vector at a time
+    while (conn->header_end == 0 &&
+           (eol = memchr(base + conn->scanned, '\n', avail - conn->scanned)) != NULL)
+    {
+        char* line = base + conn->scanned;
+        conn->scanned = eol - base + 1;
+        if (eol == line || (eol == line + 1 && *line == '\r'))
+            conn->header_end = conn->scanned;
+    }
+    if (conn->header_end == 0)
+        return avail == CONN_BUFSIZE ? -1 : 0;
+
+    req->connection = -1;
+    req->if_none_match.ptr = NULL;
+    req->if_none_match.len = 0;
+    req->content_length = 0;
+
+    // request line, then one header per line up to the blank one
+    eol = memchr(base, '\n', conn->header_end);
+    parse_request_line(base, eol - base, req);
+
+    req->headers.ptr = eol + 1;
+    req->headers.len = 0;
+    while (eol + 1 < base + conn->header_end)
+    {
+        char* line = eol + 1;
+        eol = memchr(line, '\n', base + conn->header_end - line);
+        if (eol == line || (eol == line + 1 && *line == '\r'))
+            break;
+        parse_header(line, (eol[-1] == '\r' ? eol - 1 : eol) - line, req);
+        req->headers.len = eol + 1 - req->headers.ptr;
+    }
+
+    if (conn->header_end + req->content_length > CONN_BUFSIZE)
+        return -1;
+    if (conn->header_end + req->content_length > avail)
+        return 0;
+
+    req->body.ptr = base + conn->header_end;
+    req->body.len = req->content_length;
+    req->length = conn->header_end + req->content_length;
+    return 1;
+}
+
+/*
+ * Drop a request returned by conn_parse from the buffer.
+ */
+void conn_consume(conn_t* conn, request_t* req)
+{
+    conn->start += req->length;
+    conn->scanned = 0;
+    conn->header_end = 0;
+    if (conn->start == conn->end)
+    {
+        conn->start = 0;
+        conn->end = 0;
+    }
+}
+
+static conn_t* slab_conn(int id)
+{
+    conn_t* chunk = __atomic_load_n(&chunks[id >> CONN_CHUNK_BITS], __ATOMIC_ACQUIRE);
+    return &chunk[id & (CONN_CHUNK - 1)];
+}
+
+static conn_t* pop_free()
+{
+    uint64_t head = __atomic_load_n(&free_head, __ATOMIC_ACQUIRE);
+    uint64_t next;
+    conn_t* conn;
+
+    do
+    {
+        if ((uint32_t) head == 0)
+            return NULL;
+        conn = slab_conn((uint32_t) head - 1);
+        next = ((head >> 32) + 1) << 32 |
+               (uint32_t) (__atomic_load_n(&conn->slab_next, __ATOMIC_RELAXED) + 1);
+    } while (!__atomic_compare_exchange_n(&free_head, &head, next, 1,
+                __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+    return conn;
+}
+
+static void push_free(conn_t* conn)
+{
+    uint64_t head = __atomic_load_n(&free_head, __ATOMIC_RELAXED);
+
+    do
+    {
+        __atomic_store_n(&conn->slab_next, (int) (uint32_t) head - 1, __ATOMIC_RELAXED);
+    } while (!__atomic_compare_exchange_n(&free_head, &head,
+                (head & ~(uint64_t) UINT32_MAX) | (uint32_t) (conn->slab_id + 1), 1,
+                __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * Add a chunk to the slab, keep its first connection for the caller and
+ * put the rest on the free list. Another thread may have freed one while
+ * we waited for the lock, in which case that one is used instead.
+ */
+static conn_t* grow_slab()
+{
+    conn_t* chunk;
+    conn_t* conn;
+    int i, base;
+
+    pthread_mutex_lock(&grow_lock);
+    if ((conn = pop_free()) != NULL || chunk_count == CONN_MAX_CHUNKS ||
+        (chunk = (conn_t*) malloc(sizeof(conn_t) * CONN_CHUNK)) == NULL)
+    {
+        pthread_mutex_unlock(&grow_lock);
+        return conn;
+    }
+    base = chunk_count << CONN_CHUNK_BITS;
+    for (i = 0; i < CONN_CHUNK; i++)
+        chunk[i].slab_id = base + i;
+    __atomic_store_n(&chunks[chunk_count++], chunk, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&grow_lock);
+
+    for (i = CONN_CHUNK - 1; i > 0; i--)
+        push_free(&chunk[i]);
+    return &chunk[0];
+}
+
+int slice_equals(slice_t s, char* str)
+{
+    int n = strlen(str);
+    return s.len == n && memcmp(s.ptr, str, n) == 0;
+}
+
+/*
+ * The first parameter called name, as an int: 1 if it is there and holds
+ * a decimal number that fits, 0 if it is not there and -1 if it is not a
+ * number or is out of range. *value is only set for 1.
+ */
+int query_int(query_t* q, char* name, int* value)
+{
+    query_param_t* param = find_param(q, name);
+    char* p;
+    int rc;
+
+    if (param == NULL)
+        return 0;
+    p = param->value.ptr;
+    rc = next_int(&p, param->value.ptr + param->value.len, value);
+    return rc == 1 ? 1 : -1;
+}
+
+/*
+ * A comma separated list of numbers in the first parameter called name,
+ * as in "seat=1,2,3". Fills at most max values and returns how many there
+ * were; a longer list returns max + 1 so the caller can tell. 0 if there
+ * is no such parameter, -1 if an item is not a number that fits.
+ */
+int query_int_list(query_t* q, char* name, int* values, int max)
+{
+    query_param_t* param = find_param(q, name);
+    char* p;
+    char* end;
+    int count = 0, value, rc;
+
+    if (param == NULL)
+        return 0;
+    p = param->value.ptr;
+    end = p + param->value.len;
+    do
+    {
+        if ((rc = next_int(&p, end, &value)) == 0)
+            return -1;
+        if (count == max)
+            return max + 1;
+        values[count++] = value;
+    } while (rc == ',');
+    return count;
+}
+
+// whether the first parameter called name has exactly this value
+int query_equals(query_t* q, char* name, char* value)
+{
+    query_param_t* param = find_param(q, name);
+    return param != NULL && decoded_equals(param->value, value, 1);
+}
+
+/*
+ * Decode the path where it lies and NUL terminate it; decoding only ever
+ * shortens it, and the byte after it (the '?' or the space before the
+ * version) is no longer needed. Returns the decoded length, or -1 for a
+ * bad escape or one that decodes to NUL.
+ */
+int query_decode_path(query_t* q)
+{
+    char* p = q->path.ptr;
+    char* end = p + q->path.len;
+    char* out = p;
+    int c;
+
+    while ((c = next_decoded(&p, end, 0)) >= 0)
+    {
+        if (c == '\0')
+            return -1;
+        *out++ = c;
+    }
+    if (c == DECODE_ERROR)
+        return -1;
+    *out = '\0';
+    q->path.len = out - q->path.ptr;
+    return q->path.len;
+}
+
+/*
+ * Split the target in one pass: the path runs to the first '?', then
+ * each parameter to the next separator, its name to its first '='.
+ */
+static void parse_query(slice_t target, query_t* q)
+{
+    char* p = target.ptr;
+    char* end = p + target.len;
+    char* eq;
+    query_param_t* param;
+
+    q->path.ptr = p;
+    while (p < end && *p != '?')
+        p++;
+    q->path.len = p - q->path.ptr;
+    q->count = 0;
+
+    while (p < end && q->count < QUERY_MAX_PARAMS)
+    {
+        param = &q->params[q->count];
+        param->name.ptr = ++p;
+        eq = NULL;
+        while (p < end && *p != '&' && *p != '?')
+        {
+            if (*p == '=' && eq == NULL)
+                eq = p;
+            p++;
+        }
+        if (p == param->name.ptr)
+            continue;
+        param->name.len = (eq != NULL ? eq : p) - param->name.ptr;
+        param->value.ptr = eq != NULL ? eq + 1 : p;
+        param->value.len = p - param->value.ptr;
+        q->count++;
+    }
+
+    // anything but separators left over is a parameter we had no room for
+    while (p < end && (*p == '&' || *p == '?'))
+        p++;
+    q->overflow = p < end;
+}
+
+static query_param_t* find_param(query_t* q, char* name)
+{
+    int i;
+
+    for (i = 0; i < q->count; i++)
+    {
+        if (decoded_equals(q->params[i].name, name, 1))
+            return &q->params[i];
+    }
+    return NULL;
+}
+
+/*
+ * Read an optionally signed decimal int from *p, decoding as we go, up to
+ * the end of the slice or a ','. Returns ',' if a comma ended it (*p is
+ * then past it), 1 if the slice did, or 0 if what is there is not a
+ * number that fits in an int.
+ */
+static int next_int(char** p, char* end, int* value)
+{
+    long n = 0;
+    int c, digits = 0, negative = 0;
+
+    c = next_decoded(p, end, 1);
+    if (c == '-' || c == '+')
+    {
+        negative = c == '-';
+        c = next_decoded(p, end, 1);
+    }
+    for (; c >= '0' && c <= '9'; c = next_decoded(p, end, 1))
+    {
+        n = n * 10 + (c - '0');
+        if (n > (long) INT_MAX + negative)
+            return 0;
+        digits++;
+    }
+    if (digits == 0 || (c != DECODE_END && c != ','))
+        return 0;
+    *value = negative ? (int) -n : (int) n;
+    return c == ',' ? ',' : 1;
+}
+
+// compare a still encoded slice with a plain string
+static int decoded_equals(slice_t s, char* str, int plus_is_space)
+{
+    char* p = s.ptr;
+    char* end = p + s.len;
+    int c;
+
+    while ((c = next_decoded(&p, end, plus_is_space)) >= 0)
+    {
+        if (*str == '\0' || c != (unsigned char) *str++)
+            return 0;
+    }
+    return c == DECODE_END && *str == '\0';
+}
+
+/*
+ * The next character of an encoded slice, with %XX escapes (and, in a
+ * query, '+' for space) decoded; DECODE_END at the end of the slice and
+ * DECODE_ERROR for a malformed escape.
+ */
+static int next_decoded(char** p, char* end, int plus_is_space)
+{
+    int hi, lo;
+    char* s = *p;
+
+    if (s >= end)
+        return DECODE_END;
+    if (*s == '+' && plus_is_space)
+    {
+        *p = s + 1;
+        return ' ';
+    }
+    if (*s != '%')
+    {
+        *p = s + 1;
+        return (unsigned char) *s;
+    }
+    if (end - s < 3 || (hi = hex_value(s[1])) < 0 || (lo = hex_value(s[2])) < 0)
+        return DECODE_ERROR;
+    *p = s + 3;
+    return hi << 4 | lo;
+}
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+// Expected format: 'GET filename.txt HTTP/1.X'
+static void parse_request_line(char* line, int length, request_t* req)
+{
+    char* end;
+    char* sp;
+
+    if (length > 0 && line[length-1] == '\r')
+        length--;
+    end = line + length;
+
+    req->method.ptr = line;
+    sp = memchr(line, ' ', length);
+    req->method.len = (sp != NULL ? sp : end) - line;
+
+    req->target.ptr = sp != NULL ? sp + 1 : end;
+    sp = memchr(req->target.ptr, ' ', end - req->target.ptr);
+    req->target.len = (sp != NULL ? sp : end) - req->target.ptr;
+    parse_query(req->target, &req->query);
+
+    req->version.ptr = sp != NULL ? sp + 1 : end;
+    req->version.len = end - req->version.ptr;
+}
+
+static void parse_header(char* line, int length, request_t* req)
+{
+    char* value;
+
+    if (length > 11 && strncasecmp(line, "Connection:", 11) == 0)
+    {
+        value = line + 11;
+        while (*value == ' ' || *value == '\t')
+            value++;
+        if (strncasecmp(value, "close", 5) == 0)
+            req->connection = 0;
+        else if (strncasecmp(value, "keep-alive", 10) == 0)
+            req->connection = 1;
+    }
+    else if (length > 15 && strncasecmp(line, "Content-Length:", 15) == 0)
+    {
+        long n = strtol(line + 15, NULL, 10);
+        // anything that cannot fit is rejected by conn_parse
+        req->content_length = (n < 0) ? 0 : (n > CONN_BUFSIZE ? CONN_BUFSIZE + 1 : n);
+    }
+    else if (length > 14 && strncasecmp(line, "If-None-Match:", 14) == 0)
+    {
+        value = line + 14;
+        while (*value == ' ' || *value == '\t')
+            value++;
+        req->if_none_match.ptr = value;
+        req->if_none_match.len = line + length - value;
+    }
+}
@@ -0,0 +1,103 @@
+#ifndef _CONN_H_
+#define _CONN_H_
+
+#define CONN_BUFSIZE 2048
+
+/*
+ * A piece of a connection's input buffer. Not NUL terminated.
+ */
+typedef struct slice_t
+{
+    char* ptr;
+    int len;
+} slice_t;
+
+/*
+ * A request target split once into its path and query parameters. The
+ * slices are left percent-encoded; the query_ functions decode as they
+ * read. Parameters are separated by '&' or, as some clients send them,
+ * '?'. overflow is set when there were more than QUERY_MAX_PARAMS, and
+ * the request should be refused: the ones past it are not kept.
+ */
+#define QUERY_MAX_PARAMS 16
+
+typedef struct query_param_t
+{
+    slice_t name;
+    slice_t value;
+} query_param_t;
+
+typedef struct query_t
+{
+    slice_t path;
+    int count;
+    int overflow;
+    query_param_t params[QUERY_MAX_PARAMS];
+} query_t;
+
+/*
+ * A parsed request. All slices point into the connection buffer and stay
+ * valid until the request is consumed. connection is -1 when the client
+ * sent no Connection header; if_none_match is empty when it sent no
+ * If-None-Match.
+ */
+typedef struct request_t
+{
+    slice_t method;
+    slice_t target;
+    query_t query;
+    slice_t version;
+    slice_t headers;
+    slice_t body;
+    slice_t if_none_match;
+    int connection;
+    int content_length;
+    int length;
+} request_t;
+
+/*
+ * Per-connection state. Bytes buf[start..end) have been read but not yet
+ * consumed by a request; scanned and header_end remember how far the
+ * search for the end of the current request's headers has got, relative
+ * to start, so data arriving in pieces is only looked at once.
+ *
+ * loop to next belong to the event loop: a connection waiting for a
+ * request sits on its loop's idle list, oldest deadline first.
+ *
+ * The request being parsed is kept here too, so that parsing it needs
+ * neither the heap nor much stack; its response is built in the serving
+ * thread's own buffers. Connections come from conn_alloc and go back
+ * with conn_free.
+ */
+typedef struct conn_t
+{
+    int fd;
+    int start;
+    int end;
+    int scanned;
+    int header_end;
+    int requests;
+    struct event_loop_t* loop;
+    long deadline;
+    struct conn_t* prev;
+    struct conn_t* next;
+    int slab_id;
+    int slab_next;
+    request_t req;
+    char buf[CONN_BUFSIZE+1];
+} conn_t;
+
+conn_t* conn_alloc(int fd);
+void conn_free(conn_t* conn);
+void conn_init(conn_t* conn, int fd);
+int conn_fill(conn_t* conn);
+int conn_parse(conn_t* conn, request_t* req);
+void conn_consume(conn_t* conn, request_t* req);
+
+int query_int(query_t* q, char* name, int* value);
+int query_int_list(query_t* q, char* name, int* values, int max);
+int query_equals(query_t* q, char* name, char* value);
+int query_decode_path(query_t* q);
+int slice_equals(slice_t s, char* str);
+
+#endif
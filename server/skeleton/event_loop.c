@@ -0,0 +1,334 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include "event_loop.h"
+#include "util.h"
+
+#define MAX_EVENTS 64
+
+struct event_loop_t
+{
+    int epfd;
+    int listenfd;
+    int wakefd;
+    pool_t** pools;
+    int pool_count;
+    pthread_mutex_t idle_lock;
+    conn_t idle;
+};
+
+static void accept_connections(event_loop_t* loop);
+static void read_connection(event_loop_t* loop, conn_t* conn);
+static void close_idle_connections(event_loop_t* loop);
+static int next_timeout(event_loop_t* loop);
+static void idle_insert(event_loop_t* loop, conn_t* conn);
+static void idle_remove(event_loop_t* loop, conn_t* conn);
+static long now_ms();
+
+/*
+ * Create an event loop serving listenfd. Complete requests are passed to
+ * handle_buffered_connection on one of pool_count pools, chosen by the
+ * venue= of the first request read: venue % pool_count. Requests
+ * pipelined behind it are served on the same pool whatever their venue,
+ * which is safe since seats may be worked on from any thread; routing
+ * only keeps each venue mostly on one CPU.
+ */
+event_loop_t* event_loop_create(int listenfd, pool_t** pools, int pool_count)
+{
+    struct epoll_event ev;
+    event_loop_t* loop = (event_loop_t*) malloc(sizeof(event_loop_t));
+    int rc;
+
+    loop->epfd = epoll_create1(0);
+    loop->wakefd = eventfd(0, EFD_NONBLOCK);
+    if (loop->epfd < 0 || loop->wakefd < 0)
+    {
+        perror("epoll_create1");
+        if (loop->epfd >= 0)
+            close(loop->epfd);
+        free(loop);
+        return NULL;
+    }
+    loop->listenfd = listenfd;
+    loop->pools = pools;
+    loop->pool_count = pool_count;
+    pthread_mutex_init(&loop->idle_lock, NULL);
+    loop->idle.prev = &loop->idle;
+    loop->idle.next = &loop->idle;
+
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL, 0) | O_NONBLOCK);
+
+    // the listening socket is the only one registered with a NULL pointer,
+    // and the wakeup from event_loop_stop the only one with the loop's
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    rc = epoll_ctl(loop->epfd, EPOLL_CTL_ADD, listenfd, &ev);
+    ev.data.ptr = loop;
+    if (rc != 0 || epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakefd, &ev) != 0)
+    {
+        perror("epoll_ctl");
+        close(loop->epfd);
+        close(loop->wakefd);
+        free(loop);
+        return NULL;
+    }
+    return loop;
+}
+
+/*
+ * Wait for events until event_loop_stop is called. Only the thread
+ * calling this touches a connection until it has been handed to the pool.
+ */
+void event_loop_run(event_loop_t* loop)
+{
+    struct epoll_event events[MAX_EVENTS];
+    int i, n;
+
+    while(1)
+    {
+        n = epoll_wait(loop->epfd, events, MAX_EVENTS, next_timeout(loop));
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait");
+            return;
+        }
+        for (i = 0; i < n; i++)
+        {
+            if (events[i].data.ptr == loop)
+                return;
+            if (events[i].data.ptr == NULL)
+                accept_connections(loop);
+            else
+                read_connection(loop, (conn_t*) events[i].data.ptr);
+        }
+        close_idle_connections(loop);
+    }
+}
+
+/*
+ * Give a kept-alive connection back to the loop to wait for its next
+ * request. Called by the worker that served the previous one.
+ */
+void event_loop_rearm(conn_t* conn)
+{
+    event_loop_t* loop = conn->loop;
+    struct epoll_event ev;
+
+    idle_insert(loop, conn);
+
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = conn;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, conn->fd, &ev) != 0)
+    {
+        perror("epoll_ctl");
+        idle_remove(loop, conn);
+        event_loop_release(conn);
+    }
+}
+
+/*
+ * Close a connection and return its state to the slab. Called by the
+ * worker once the response has been written.
+ */
+void event_loop_release(conn_t* conn)
+{
+    close(conn->fd);
+    conn_free(conn);
+}
+
+/*
+ * Make event_loop_run return. Only writes to the loop's eventfd, so it may
+ * be called from a signal handler, and more than once.
+ */
+int event_loop_stop(event_loop_t* loop)
+{
+    uint64_t one = 1;
+    return write(loop->wakefd, &one, sizeof(one)) == sizeof(one) ? 0 : -1;
+}
+
+/*
+ * Free a loop once event_loop_run has returned and no worker will hand a
+ * connection back to it. Connections still waiting in it are dropped with
+ * the process.
+ */
+void event_loop_destroy(event_loop_t* loop)
+{
+    close(loop->listenfd);
+    close(loop->wakefd);
+    close(loop->epfd);
+    pthread_mutex_destroy(&loop->idle_lock);
+    free(loop);
+}
+
+static void accept_connections(event_loop_t* loop)
+{
+    struct epoll_event ev;
+    int connfd;
+
+    while ((connfd = accept4(loop->listenfd, NULL, NULL, SOCK_NONBLOCK)) >= 0)
+    {
+        conn_t* conn = conn_alloc(connfd);
+        if (conn == NULL)
+        {
+            close(connfd);
+            continue;
+        }
+        conn->loop = loop;
+        idle_insert(loop, conn);
+
+        // one shot: the connection is disarmed while we look at it
+        ev.events = EPOLLIN | EPOLLONESHOT;
+        ev.data.ptr = conn;
+        if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, connfd, &ev) != 0)
+        {
+            perror("epoll_ctl");
+            idle_remove(loop, conn);
+            event_loop_release(conn);
+        }
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        perror("accept");
+}
+
+static void read_connection(event_loop_t* loop, conn_t* conn)
+{
+    struct epoll_event ev;
+    request_t req;
+    pool_t* pool;
+    int n, venue = 0, priority = 0;
+
+    n = conn_fill(conn);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS))
+    {
+        idle_remove(loop, conn);
+        event_loop_release(conn);
+        return;
+    }
+
+    // an oversized request is passed on and answered with an error; a
+    // complete one is queued on its venue's pool at its customer's
+    // priority, or refused if that pool is overloaded
+    n = conn_parse(conn, &req);
+    if (n != 0)
+    {
+        idle_remove(loop, conn);
+        if (n > 0)
+        {
+            query_int(&req.query, "venue", &venue);
+            query_int(&req.query, "priority", &priority);
+        }
+        pool = loop->pools[(venue < 0 ? 0 : venue) % loop->pool_count];
+        if (admit_task(pool, &handle_buffered_connection, (void*) conn, priority) != 0)
+        {
+            send_unavailable(conn);
+            event_loop_release(conn);
+        }
+        return;
+    }
+
+    // still waiting; the deadline set when the wait began stays
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = conn;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, conn->fd, &ev) != 0)
+    {
+        perror("epoll_ctl");
+        idle_remove(loop, conn);
+        event_loop_release(conn);
+    }
+}
+
+/*
+ * Close connections that have waited longer than keepalive_timeout for a
+ * request. The list is ordered by deadline, so we stop at the first one
+ * still in time.
+ */
+static void close_idle_connections(event_loop_t* loop)
+{
+    long now = now_ms();
+    conn_t* conn;
+
+    while(1)
+    {
+        pthread_mutex_lock(&loop->idle_lock);
+        conn = loop->idle.next;
+        if (conn == &loop->idle || conn->deadline > now)
+        {
+            pthread_mutex_unlock(&loop->idle_lock);
+            return;
+        }
+        conn->prev->next = conn->next;
+        conn->next->prev = conn->prev;
+        conn->prev = NULL;
+        conn->next = NULL;
+        pthread_mutex_unlock(&loop->idle_lock);
+
+        event_loop_release(conn);
+    }
+}
+
+/*
+ * Milliseconds until the oldest idle connection expires, or -1 if there is
+ * none.
+ */
+static int next_timeout(event_loop_t* loop)
+{
+    long timeout = -1;
+
+    pthread_mutex_lock(&loop->idle_lock);
+    if (loop->idle.next != &loop->idle)
+    {
+        timeout = loop->idle.next->deadline - now_ms();
+        if (timeout < 0)
+            timeout = 0;
+    }
+    pthread_mutex_unlock(&loop->idle_lock);
+    return (int) timeout;
+}
+
+static void idle_insert(event_loop_t* loop, conn_t* conn)
+{
+    conn->deadline = now_ms() + keepalive_timeout * 1000L;
+
+    pthread_mutex_lock(&loop->idle_lock);
+    conn->next = &loop->idle;
+    conn->prev = loop->idle.prev;
+    loop->idle.prev->next = conn;
+    loop->idle.prev = conn;
+    pthread_mutex_unlock(&loop->idle_lock);
+}
+
+static void idle_remove(event_loop_t* loop, conn_t* conn)
+{
+    pthread_mutex_lock(&loop->idle_lock);
+    if (conn->next != NULL)
+    {
+        conn->prev->next = conn->next;
+        conn->next->prev = conn->prev;
+        conn->prev = NULL;
+        conn->next = NULL;
+    }
+    pthread_mutex_unlock(&loop->idle_lock);
+}
+
+static long now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
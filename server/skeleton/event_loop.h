@@ -0,0 +1,16 @@
+#ifndef _EVENT_LOOP_H_
+#define _EVENT_LOOP_H_
+
+#include "thread_pool.h"
+#include "conn.h"
+
+typedef struct event_loop_t event_loop_t;
+
+event_loop_t* event_loop_create(int listenfd, pool_t** pools, int pool_count);
+void event_loop_run(event_loop_t* loop);
+int event_loop_stop(event_loop_t* loop);
+void event_loop_rearm(conn_t* conn);
+void event_loop_release(conn_t* conn);
+void event_loop_destroy(event_loop_t* loop);
+
+#endif
@@ -0,0 +1,405 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+#include "file_cache.h"
+#include "util.h"
+
+#define CACHE_BUCKETS 256
+#define WATCH_BUCKETS 64
+
+// the cached entries using one inotify watch
+typedef struct watch_t
+{
+    int wd;
+    cache_entry_t* entries;
+    struct watch_t* next;
+} watch_t;
+
+/*
+ * Hash table of entries by path, plus an LRU list through prev/next with
+ * the most recently used entry first. One lock covers both and the
+ * reference counts; it is only held for pointer updates, never for I/O.
+ *
+ * Entries are invalidated by inotify when it is available. Otherwise a hit
+ * stats the file at most once a second and drops the entry if its mtime
+ * or size changed. A watch is removed once no cached entry uses it, so
+ * the number of watches follows what is cached rather than every path
+ * ever served. The cached entries on each watch are kept by watch
+ * descriptor, so neither an event nor a removal has to walk the cache.
+ */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static cache_entry_t* buckets[CACHE_BUCKETS];
+static cache_entry_t lru;
+static long cache_bytes = 0;
+static long cache_max = 0;
+
+static int inotify_fd = -1;
+static watch_t* watches[WATCH_BUCKETS];
+static pthread_t watcher;
+static unsigned long generation = 0;
+
+static void* watch_files(void* arg);
+static cache_entry_t* load_entry(char* path, char* type);
+static void unlink_entry(cache_entry_t* entry);
+static void hold_watch(cache_entry_t* entry);
+static void release_watch(int wd);
+static watch_t** find_watch(int wd);
+static void free_entry(cache_entry_t* entry);
+static unsigned int hash_path(char* path);
+
+/*
+ * Set up a cache holding at most max_bytes of files and headers. Returns -1
+ * if caching is disabled.
+ */
+int file_cache_init(long max_bytes)
+{
+    cache_max = max_bytes;
+    lru.prev = &lru;
+    lru.next = &lru;
+    if (cache_max <= 0)
+        return -1;
+
+    inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd < 0)
+    {
+        perror("inotify_init1");
+    }
+    else if (pthread_create(&watcher, NULL, watch_files, NULL) != 0)
+    {
+        close(inotify_fd);
+        inotify_fd = -1;
+    }
+    return 0;
+}
+
+/*
+ * Look up path, loading it on a miss. Returns NULL if the file cannot be
+ * served from memory, in which case the caller should fall back to reading
+ * it. The entry must be given back with file_cache_release.
+ */
+cache_entry_t* file_cache_get(char* path, char* type)
+{
+    cache_entry_t* entry;
+    cache_entry_t* loaded;
+    unsigned int h = hash_path(path);
+    unsigned long gen;
+    struct stat st;
+
+    if (cache_max <= 0)
+        return NULL;
+
+    pthread_mutex_lock(&cache_lock);
+    for (entry = buckets[h]; entry != NULL; entry = entry->hnext)
+    {
+        if (strcmp(entry->path, path) == 0)
+            break;
+    }
+
+    // without inotify we have to look at the file now and then
+    if (entry != NULL && inotify_fd < 0 && entry->checked != time(NULL))
+    {
+        entry->checked = time(NULL);
+        if (stat(path, &st) != 0 || st.st_mtime != entry->mtime || st.st_size != entry->size)
+        {
+            unlink_entry(entry);
+            entry = NULL;
+        }
+    }
+
+    if (entry != NULL)
+    {
+        // move to the front of the LRU list
+        entry->prev->next = entry->next;
+        entry->next->prev = entry->prev;
+        entry->next = lru.next;
+        entry->prev = &lru;
+        lru.next->prev = entry;
+        lru.next = entry;
+        entry->refs++;
+        pthread_mutex_unlock(&cache_lock);
+        return entry;
+    }
+    gen = generation;
+    pthread_mutex_unlock(&cache_lock);
+
+    loaded = load_entry(path, type);
+    if (loaded == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&cache_lock);
+    for (entry = buckets[h]; entry != NULL; entry = entry->hnext)
+    {
+        if (strcmp(entry->path, path) == 0)
+            break;
+    }
+    if (entry != NULL)
+    {
+        // somebody else loaded it first
+        entry->refs++;
+        release_watch(loaded->wd);
+        pthread_mutex_unlock(&cache_lock);
+        free_entry(loaded);
+        return entry;
+    }
+
+    // a change seen while we were reading means what we read may be stale,
+    // so it is served this once and not kept
+    if (gen == generation)
+    {
+        while (cache_bytes + loaded->size + loaded->header_len > cache_max && lru.prev != &lru)
+            unlink_entry(lru.prev);
+
+        loaded->cached = 1;
+        loaded->hnext = buckets[h];
+        buckets[h] = loaded;
+        loaded->next = lru.next;
+        loaded->prev = &lru;
+        lru.next->prev = loaded;
+        lru.next = loaded;
+        cache_bytes += loaded->size + loaded->header_len;
+        hold_watch(loaded);
+    }
+    else
+    {
+        release_watch(loaded->wd);
+    }
+    pthread_mutex_unlock(&cache_lock);
+    return loaded;
+}
+
+void file_cache_release(cache_entry_t* entry)
+{
+    int dead;
+
+    pthread_mutex_lock(&cache_lock);
+    entry->refs--;
+    dead = (entry->refs == 0 && !entry->cached);
+    pthread_mutex_unlock(&cache_lock);
+
+    if (dead)
+        free_entry(entry);
+}
+
+void file_cache_destroy()
+{
+    if (inotify_fd >= 0)
+    {
+        pthread_cancel(watcher);
+        pthread_join(watcher, NULL);
+    }
+
+    // unlinking the entries removes their watches
+    pthread_mutex_lock(&cache_lock);
+    while (lru.next != &lru)
+    {
+        cache_entry_t* entry = lru.next;
+        unlink_entry(entry);
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    if (inotify_fd >= 0)
+    {
+        close(inotify_fd);
+        inotify_fd = -1;
+    }
+}
+
+/*
+ * Watcher thread: drop every entry whose file changed. Several paths can
+ * name the same file and so share a watch descriptor.
+ */
+static void* watch_files(void* arg)
+{
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event* event;
+    watch_t* watch;
+    char* p;
+    int n;
+
+    while ((n = read(inotify_fd, buf, sizeof(buf))) > 0 || (n < 0 && errno == EINTR))
+    {
+        pthread_mutex_lock(&cache_lock);
+        for (p = buf; p < buf + n; p += sizeof(struct inotify_event) + event->len)
+        {
+            event = (struct inotify_event*) p;
+            generation++;
+            // the watch goes with its last entry
+            while ((watch = *find_watch(event->wd)) != NULL)
+                unlink_entry(watch->entries);
+        }
+        pthread_mutex_unlock(&cache_lock);
+    }
+    return NULL;
+}
+
+/*
+ * Read a whole file into a new entry. The watch goes on before the file is
+ * read so that no change can slip in between, and comes off again if the
+ * file cannot be read after all.
+ */
+static cache_entry_t* load_entry(char* path, char* type)
+{
+    char header[256];
+    cache_entry_t* entry;
+    struct stat st;
+    long done = 0;
+    int fd, n;
+
+    // files that will not be kept are not worth a watch
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size > cache_max)
+        return NULL;
+
+    entry = (cache_entry_t*) calloc(1, sizeof(cache_entry_t));
+    entry->wd = -1;
+    entry->refs = 1;
+    if (inotify_fd >= 0)
+    {
+        entry->wd = inotify_add_watch(inotify_fd, path,
+                IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF);
+        if (entry->wd < 0)
+        {
+            free(entry);
+            return NULL;
+        }
+    }
+
+    if ((fd = open(path, O_RDONLY)) == -1)
+    {
+        pthread_mutex_lock(&cache_lock);
+        release_watch(entry->wd);
+        pthread_mutex_unlock(&cache_lock);
+        free(entry);
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_size > cache_max)
+    {
+        close(fd);
+        pthread_mutex_lock(&cache_lock);
+        release_watch(entry->wd);
+        pthread_mutex_unlock(&cache_lock);
+        free(entry);
+        return NULL;
+    }
+
+    entry->path = strdup(path);
+    entry->size = st.st_size;
+    entry->mtime = st.st_mtime;
+    entry->checked = time(NULL);
+    entry->data = (char*) malloc(st.st_size > 0 ? st.st_size : 1);
+    while (done < entry->size && (n = read(fd, entry->data + done, entry->size - done)) > 0)
+        done += n;
+    close(fd);
+    if (done < entry->size)
+    {
+        pthread_mutex_lock(&cache_lock);
+        release_watch(entry->wd);
+        pthread_mutex_unlock(&cache_lock);
+        free_entry(entry);
+        return NULL;
+    }
+
+    entry->header_len = render_headers(header, sizeof(header), "200 OK", type, entry->size);
+    entry->header = strdup(header);
+    return entry;
+}
+
+// must hold cache_lock
+static void unlink_entry(cache_entry_t* entry)
+{
+    cache_entry_t** pp = &buckets[hash_path(entry->path)];
+
+    while (*pp != entry)
+        pp = &(*pp)->hnext;
+    *pp = entry->hnext;
+    if (entry->wd >= 0)
+    {
+        pp = &(*find_watch(entry->wd))->entries;
+        while (*pp != entry)
+            pp = &(*pp)->wnext;
+        *pp = entry->wnext;
+    }
+    entry->prev->next = entry->next;
+    entry->next->prev = entry->prev;
+    entry->cached = 0;
+    cache_bytes -= entry->size + entry->header_len;
+    release_watch(entry->wd);
+
+    // the worker holding the last reference frees it
+    if (entry->refs == 0)
+        free_entry(entry);
+}
+
+// put a newly cached entry on its watch; must hold cache_lock
+static void hold_watch(cache_entry_t* entry)
+{
+    watch_t** pp;
+
+    if (entry->wd < 0)
+        return;
+    pp = find_watch(entry->wd);
+    if (*pp == NULL)
+    {
+        *pp = (watch_t*) calloc(1, sizeof(watch_t));
+        (*pp)->wd = entry->wd;
+    }
+    entry->wnext = (*pp)->entries;
+    (*pp)->entries = entry;
+}
+
+/*
+ * Remove the watch wd unless a cached entry still uses it: several paths
+ * can name one file and so share its watch. An entry still being loaded
+ * that shares it is not kept, since the removal counts as a change.
+ * Must hold cache_lock.
+ */
+static void release_watch(int wd)
+{
+    watch_t** pp;
+    watch_t* watch;
+
+    if (wd < 0 || inotify_fd < 0)
+        return;
+    pp = find_watch(wd);
+    if ((watch = *pp) != NULL)
+    {
+        if (watch->entries != NULL)
+            return;
+        *pp = watch->next;
+        free(watch);
+    }
+    inotify_rm_watch(inotify_fd, wd);
+}
+
+// where the watch for wd is, or would go; must hold cache_lock
+static watch_t** find_watch(int wd)
+{
+    watch_t** pp = &watches[wd % WATCH_BUCKETS];
+
+    while (*pp != NULL && (*pp)->wd != wd)
+        pp = &(*pp)->next;
+    return pp;
+}
+
+static void free_entry(cache_entry_t* entry)
+{
+    free(entry->path);
+    free(entry->header);
+    free(entry->data);
+    free(entry);
+}
+
+static unsigned int hash_path(char* path)
+{
+    unsigned int h = 5381;
+
+    while (*path)
+        h = h * 33 + (unsigned char) *path++;
+    return h % CACHE_BUCKETS;
+}
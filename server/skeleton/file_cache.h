@@ -0,0 +1,35 @@
+#ifndef _FILE_CACHE_H_
+#define _FILE_CACHE_H_
+
+#include <time.h>
+
+/*
+ * A cached static file: its contents plus the response headers up to and
+ * including Content-Length, ready to be sent. Entries are reference
+ * counted, so one that is evicted or invalidated while a worker is still
+ * sending it stays alive until file_cache_release.
+ */
+typedef struct cache_entry_t
+{
+    char* path;
+    char* header;
+    int header_len;
+    char* data;
+    long size;
+    time_t mtime;
+    time_t checked;
+    int wd;
+    int refs;
+    int cached;
+    struct cache_entry_t* hnext;
+    struct cache_entry_t* wnext;
+    struct cache_entry_t* prev;
+    struct cache_entry_t* next;
+} cache_entry_t;
+
+int file_cache_init(long max_bytes);
+cache_entry_t* file_cache_get(char* path, char* type);
+void file_cache_release(cache_entry_t* entry);
+void file_cache_destroy();
+
+#endif
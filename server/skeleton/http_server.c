@@ -1,3 +1,7 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdlib.h>
 #include <signal.h>
 #include <ctype.h>
@@ -11,22 +15,52 @@
 #include <stdbool.h>
 #include <errno.h>
 #include <time.h>
+#include <pthread.h>
+#include <sched.h>
 
 #include "thread_pool.h"
 #include "seats.h"
 #include "util.h"
+#include "event_loop.h"
+#include "file_cache.h"
 
 #define BUFSIZE 1024
 #define FILENAMESIZE 100
 
+/*
+ * With -l, each listener thread has a socket of its own bound to the port
+ * with SO_REUSEPORT, and the kernel spreads new connections across them,
+ * so no single accept loop sees them all. Every listener runs its own
+ * event loop, optionally pinned to a CPU, over the shared pools.
+ */
+typedef struct listener_t
+{
+    pthread_t thread;
+    event_loop_t* loop;
+    int cpu;
+} listener_t;
+
 void shutdown_server(int);
+static void stop_server();
+static int open_listener(struct sockaddr_in* addr, int backlog, int reuse_port);
+static void* run_listener(void* arg);
 
 int listenfd;
-pool_t* threadpool;
+pool_t** threadpools;
+int pool_count = 1;
+
+// set once every listener's loop exists, so a signal can stop them
+static listener_t* listeners = NULL;
+static int listener_count = 1;
 
 int main(int argc,char *argv[])
 {
-    int flag, num_seats = 20;
+    int num_seats = 20, i;
+    int pin_listeners = 0;
+    int nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+    listener_t* created;
+    int opt, use_event_loop = 0, pool_flags = 0, max_threads = 0, backlog = SOMAXCONN;
+    long cache_kb = 16384;
     struct sockaddr_in serv_addr;
 
     char send_buffer[BUFSIZE];
@@ -35,11 +69,98 @@ int main(int argc,char *argv[])
 
     int server_port = 8080;
 
-    if (argc > 1)
+    while ((opt = getopt(argc, argv, "ewal:p:q:d:b:k:m:c:t:s:v:")) != -1)
     {
-        num_seats = atoi(argv[1]);
+        switch (opt)
+        {
+            case 'e':
+                // read requests from an epoll loop instead of the workers
+                use_event_loop = 1;
+                break;
+            case 'l':
+                // listener threads, each with its own socket and event loop
+                listener_count = atoi(optarg);
+                use_event_loop = 1;
+                break;
+            case 'a':
+                // pin each listener thread to a CPU of its own
+                pin_listeners = 1;
+                break;
+            case 'w':
+                // per-worker deques with stealing instead of one shared queue
+                pool_flags |= POOL_WORK_STEALING;
+                break;
+            case 'p':
+                // most workers the pool may grow to under load
+                max_threads = atoi(optarg);
+                break;
+            case 'q':
+                // queued requests beyond which new ones get a 503
+                shed_queue_length = atoi(optarg);
+                break;
+            case 'd':
+                // milliseconds of queueing beyond which new requests get a 503
+                shed_queue_delay = atoi(optarg);
+                break;
+            case 'b':
+                // connections the kernel may hold waiting for accept
+                backlog = atoi(optarg);
+                break;
+            case 'k':
+                // seconds a persistent connection may wait for a request
+                keepalive_timeout = atoi(optarg);
+                break;
+            case 'm':
+                // requests served on one connection before closing it
+                keepalive_max = atoi(optarg);
+                break;
+            case 'c':
+                // kilobytes of static files to keep in memory, 0 for none
+                cache_kb = atol(optarg);
+                break;
+            case 't':
+                // seconds before an unconfirmed seat is released, 0 for never
+                hold_ttl = atoi(optarg);
+                break;
+            case 's':
+                // directory to keep confirmed seats in across restarts
+                seat_store_dir = optarg;
+                break;
+            case 'v':
+                // venues, each with its own seats (and, with -e, spread
+                // over a pool per CPU)
+                venue_count = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-e] [-w] [-l listeners] [-a] [-p max_threads] [-q shed_length] [-d shed_delay_ms] [-b backlog] [-k idle_timeout] [-m max_requests] [-c cache_kb] [-t hold_ttl] [-s state_dir] [-v venues] [num_seats]\n", argv[0]);
+                exit(-1);
+        }
+    }
+
+    if (keepalive_timeout < 1 || keepalive_max < 1)
+    {
+        fprintf(stderr,"INVALID KEEP-ALIVE SETTINGS: timeout %d, max requests %d\n",
+                keepalive_timeout, keepalive_max);
+        exit(-1);
+    }
+
+    // without the event loop a connection waiting for its next request
+    // would hold a worker in read(), so each one is closed after its
+    // first request, as it always was; -e keeps them alive
+    if (!use_event_loop)
+        keepalive_max = 1;
+
+    if (optind < argc)
+    {
+        num_seats = atoi(argv[optind]);
     } 
 
+    if (listener_count < 1)
+    {
+        fprintf(stderr,"INVALID LISTENER COUNT: %d\n", listener_count);
+        exit(-1);
+    }
+
     if (server_port < 1500)
     {
         fprintf(stderr,"INVALID PORT NUMBER: %d; can't be < 1500\n",server_port);
@@ -49,19 +170,28 @@ int main(int argc,char *argv[])
     if (signal(SIGINT, shutdown_server) == SIG_ERR) 
         printf("Issue registering SIGINT handler");
 
-    listenfd = socket(AF_INET, SOCK_STREAM, 0);
-    if ( listenfd < 0 ){
-        perror("Socket");
-        exit(errno);
-    }
-    printf("Established Socket: %d\n", listenfd);
-    flag = 1;
-    setsockopt( listenfd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag) );
+    // a client that goes away mid-response is answered with EPIPE on that
+    // connection, not a signal that takes the whole server down
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+        printf("Issue ignoring SIGPIPE");
 
     // initialize the threadpool
     // Set the number of threads and size of the queue
-    threadpool = pool_create(200,20);
+    // With the event loop and several venues there is a pool on each CPU,
+    // up to one a venue, and venues are spread over them by venue= before
+    // any worker sees the request
+    if (use_event_loop && venue_count > 1)
+        pool_count = venue_count < nprocs ? venue_count : nprocs;
+    threadpools = (pool_t**) malloc(sizeof(pool_t*) * pool_count);
+    for (i = 0; i < pool_count; i++)
+    {
+        threadpools[i] = pool_create(200,max_threads,pool_flags);
+        if (pool_count > 1)
+            pool_pin(threadpools[i], i);
+    }
+
 
+    file_cache_init(cache_kb * 1024);
 
     // Load the seats;
     load_seats(num_seats); //TODO read from argv
@@ -73,28 +203,140 @@ int main(int argc,char *argv[])
     serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
     serv_addr.sin_port = htons(server_port);
 
+    listenfd = open_listener(&serv_addr, backlog, listener_count > 1);
+
+    if (use_event_loop)
+    {
+        // every socket is bound before any loop starts, so a port in use
+        // is reported before we serve anything; this thread runs the first
+        created = (listener_t*) calloc(listener_count, sizeof(listener_t));
+        for (i = 0; i < listener_count; i++)
+        {
+            int fd = i == 0 ? listenfd : open_listener(&serv_addr, backlog, 1);
+            created[i].cpu = pin_listeners ? i % nprocs : -1;
+            created[i].loop = event_loop_create(fd, threadpools, pool_count);
+            if (created[i].loop == NULL)
+                exit(-1);
+        }
+        listeners = created;
+        for (i = 1; i < listener_count; i++)
+        {
+            if (pthread_create(&listeners[i].thread, NULL, run_listener, &listeners[i]) != 0)
+            {
+                perror("pthread_create");
+                exit(-1);
+            }
+        }
+
+        // the first loop returns once shutdown_server has stopped them
+        // all; the rest are waited for before anything they use goes
+        run_listener(&listeners[0]);
+        for (i = 0; i < listener_count; i++)
+            event_loop_stop(listeners[i].loop);
+        for (i = 1; i < listener_count; i++)
+            pthread_join(listeners[i].thread, NULL);
+        stop_server();
+        exit(0);
+    }
+
+    // handle connections loop (forever)
+    while(1)
+    {
+        conn_t* conn;
+        int connfd = accept(listenfd, (struct sockaddr*)NULL, NULL);
+        if (connfd < 0)
+            continue;
+        if ((conn = conn_alloc(connfd)) == NULL)
+        {
+            close(connfd);
+            continue;
+        }
+        // turn the connection away now rather than leave it in the queue
+        if (admit_task(threadpools[0], &handle_connection, (void*) conn, 0) != 0)
+        {
+            send_unavailable(conn);
+            close(connfd);
+            conn_free(conn);
+        }
+    }
+}
+
+static int open_listener(struct sockaddr_in* addr, int backlog, int reuse_port)
+{
+    int fd, flag = 1;
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if ( fd < 0 ){
+        perror("Socket");
+        exit(errno);
+    }
+    printf("Established Socket: %d\n", fd);
+    setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag) );
+    if (reuse_port && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof(flag)) != 0)
+    {
+        perror("SO_REUSEPORT");
+        exit(errno);
+    }
+
     // bind to socket
-    if ( bind(listenfd, (struct sockaddr*) &serv_addr, sizeof(serv_addr)) != 0)
+    if ( bind(fd, (struct sockaddr*) addr, sizeof(*addr)) != 0)
     {
         perror("socket--bind");
         exit(errno);
     }
 
     // listen for incoming requests
-    listen(listenfd, 10);
+    listen(fd, backlog);
+    return fd;
+}
 
-    // handle connections loop (forever)
-    while(1)
+static void* run_listener(void* arg)
+{
+    listener_t* listener = (listener_t*) arg;
+    cpu_set_t cpus;
+
+    if (listener->cpu >= 0)
     {
-        int* connfd = (int*) malloc(sizeof(int));
-        *connfd = accept(listenfd, (struct sockaddr*)NULL, NULL);
-        pool_add_task(threadpool, &handle_connection, (void*) connfd);
+        CPU_ZERO(&cpus);
+        CPU_SET(listener->cpu, &cpus);
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
     }
+    event_loop_run(listener->loop);
+    return NULL;
 }
 
+/*
+ * With the event loop, the listeners are only told to stop here and main
+ * shuts down once they have: freeing the pools and seats under a running
+ * loop would hand its connections to freed pools.
+ */
 void shutdown_server(int signo){
-    pool_destroy(threadpool);
-    unload_seats();
-    close(listenfd);
+    int i;
+
+    if (listeners != NULL)
+    {
+        for (i = 0; i < listener_count; i++)
+            event_loop_stop(listeners[i].loop);
+        return;
+    }
+    stop_server();
     exit(0);
 }
+
+// the pools first, so no worker is left using a loop or the seats
+static void stop_server()
+{
+    int i;
+
+    for (i = 0; i < pool_count; i++)
+        pool_destroy(threadpools[i]);
+    if (listeners != NULL)
+    {
+        for (i = 0; i < listener_count; i++)
+            event_loop_destroy(listeners[i].loop);
+    }
+    else
+        close(listenfd);
+    file_cache_destroy();
+    unload_seats();
+}
@@ -0,0 +1,499 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "seat_log.h"
+
+/*
+ * Changes are appended to an in-memory batch and a writer thread turns
+ * each batch into one write and one fdatasync (group commit): however many
+ * requests arrive while it is syncing share the next sync. A caller that
+ * needs its change durable waits for the log to reach its sequence number.
+ *
+ * The writer also applies every record it writes to a copy of the seats
+ * of its own, which so holds only what has been logged. Every
+ * SNAPSHOT_SECONDS, or sooner once SNAPSHOT_RECORDS have been logged, it
+ * writes that copy into a new snapshot file through a shared mapping,
+ * renames it over the old one and empties the log. The live seats are
+ * never copied: they can hold changes that are not logged yet, or that
+ * are about to be undone. A restart maps the snapshot copy-on-write, so
+ * the seats are usable at once, and replays only the log written since.
+ */
+#define SNAPSHOT_SECONDS 60
+#define SNAPSHOT_RECORDS 65536
+#define SNAPSHOT_MAGIC "SEATSNP1"
+#define LOG_RETRIES 5
+#define LAYOUT_SEAT 0xffffffffu
+
+typedef struct log_record_t
+{
+    uint64_t lsn;
+    uint64_t word;
+    uint32_t seat;
+    uint32_t check;
+} log_record_t;
+
+/*
+ * Padded so the seat words that follow are cache line aligned. A word's
+ * place depends on how many venues there are and how many seats each has,
+ * so those are kept too; the log starts with a record holding the same.
+ */
+typedef struct snapshot_header_t
+{
+    char magic[8];
+    uint64_t lsn;
+    uint64_t seat_count;
+    uint32_t venue_count;
+    uint32_t venue_seats;
+    char pad[32];
+} snapshot_header_t;
+
+typedef struct log_batch_t
+{
+    log_record_t* records;
+    int length;
+    int size;
+} log_batch_t;
+
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t log_durable = PTHREAD_COND_INITIALIZER;
+static pthread_t writer;
+static log_batch_t batches[2];
+static log_batch_t* pending = &batches[0];
+static long next_lsn = 0;
+static long durable_lsn = 0;
+static int stopping = 0;
+
+static char* snapshot_path = NULL;
+static char* snapshot_tmp_path = NULL;
+static int log_fd = -1;
+static off_t log_end = 0;
+static int dir_fd = -1;
+static uint64_t* log_seats = NULL;
+static uint64_t* logged_seats = NULL;
+static int log_seat_count = 0;
+static int log_venue_count = 0;
+static int log_venue_seats = 0;
+static void* snapshot_map = NULL;
+static size_t snapshot_map_size = 0;
+
+static void* write_log(void* arg);
+static int append_batch(log_batch_t* batch);
+static int write_snapshot(long lsn);
+static uint64_t* map_snapshot(int seat_count, uint64_t empty_word, long* lsn);
+static long replay_log(long snapshot_lsn);
+static void layout_record(log_record_t* record);
+static uint32_t record_check(log_record_t* record);
+static char* join_path(char* dir, char* name);
+
+/*
+ * Recover the seat array kept in dir (created if need be) and start
+ * logging. The array is seat_count words holding venue_count venues of
+ * venue_seats seats. Seats the snapshot and log know nothing about start
+ * as empty_word. A server asked to keep its seats cannot run without
+ * them, so if the directory or log cannot be opened, or they were kept
+ * for other venues, we stop here.
+ */
+uint64_t* seat_log_open(char* dir, int venue_count, int venue_seats, int seat_count, uint64_t empty_word)
+{
+    char* log_path;
+    long snapshot_lsn;
+
+    mkdir(dir, 0755);
+    if ((dir_fd = open(dir, O_RDONLY | O_DIRECTORY)) < 0)
+    {
+        perror(dir);
+        exit(-1);
+    }
+    log_path = join_path(dir, "seats.wal");
+    log_fd = open(log_path, O_RDWR | O_CREAT | O_APPEND, 0644);
+    free(log_path);
+    if (log_fd < 0)
+    {
+        perror("seats.wal");
+        exit(-1);
+    }
+    snapshot_path = join_path(dir, "seats.snap");
+    snapshot_tmp_path = join_path(dir, "seats.snap.tmp");
+
+    log_seat_count = seat_count;
+    log_venue_count = venue_count;
+    log_venue_seats = venue_seats;
+    log_seats = map_snapshot(seat_count, empty_word, &snapshot_lsn);
+    next_lsn = replay_log(snapshot_lsn);
+    durable_lsn = next_lsn;
+    logged_seats = (uint64_t*) malloc(sizeof(uint64_t) * (seat_count > 0 ? seat_count : 1));
+    memcpy(logged_seats, log_seats, sizeof(uint64_t) * seat_count);
+
+    if (pthread_create(&writer, NULL, write_log, NULL) != 0)
+    {
+        perror("pthread_create");
+        exit(-1);
+    }
+    return log_seats;
+}
+
+/*
+ * Log a seat's new word. The change is durable once seat_log_wait on the
+ * returned sequence number comes back.
+ */
+long seat_log_append(int seat_id, uint64_t word)
+{
+    log_record_t* record;
+    long lsn;
+
+    pthread_mutex_lock(&log_lock);
+    if (pending->length == pending->size)
+    {
+        pending->size = pending->size > 0 ? pending->size * 2 : 256;
+        pending->records = (log_record_t*) realloc(pending->records, sizeof(log_record_t) * pending->size);
+    }
+    record = &pending->records[pending->length++];
+    record->lsn = lsn = ++next_lsn;
+    record->word = word;
+    record->seat = seat_id;
+    record->check = record_check(record);
+    pthread_cond_signal(&log_work);
+    pthread_mutex_unlock(&log_lock);
+    return lsn;
+}
+
+void seat_log_wait(long lsn)
+{
+    pthread_mutex_lock(&log_lock);
+    while (durable_lsn < lsn)
+        pthread_cond_wait(&log_durable, &log_lock);
+    pthread_mutex_unlock(&log_lock);
+}
+
+/*
+ * Flush the log, take a last snapshot so the next start has nothing to
+ * replay, and release the seat array returned by seat_log_open.
+ */
+void seat_log_close()
+{
+    pthread_mutex_lock(&log_lock);
+    stopping = 1;
+    pthread_cond_signal(&log_work);
+    pthread_mutex_unlock(&log_lock);
+    pthread_join(writer, NULL);
+
+    if (snapshot_map != NULL)
+        munmap(snapshot_map, snapshot_map_size);
+    else
+        free(log_seats);
+    close(log_fd);
+    close(dir_fd);
+    free(snapshot_path);
+    free(snapshot_tmp_path);
+    free(batches[0].records);
+    free(batches[1].records);
+    free(logged_seats);
+    snapshot_map = NULL;
+    log_seats = NULL;
+    logged_seats = NULL;
+}
+
+static void* write_log(void* arg)
+{
+    log_batch_t* batch;
+    struct timespec deadline;
+    time_t last_snapshot = time(NULL);
+    long logged = 0, lsn;
+    int done = 0, i, tries;
+
+    while (!done)
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += 1;
+
+        pthread_mutex_lock(&log_lock);
+        while (pending->length == 0 && !stopping)
+        {
+            if (pthread_cond_timedwait(&log_work, &log_lock, &deadline) == ETIMEDOUT)
+                break;
+        }
+        // swap batches: requests fill the other one while we write this one
+        batch = pending;
+        pending = (pending == &batches[0]) ? &batches[1] : &batches[0];
+        done = stopping && batch->length == 0;
+        pthread_mutex_unlock(&log_lock);
+
+        if (batch->length > 0)
+        {
+            // nobody hears back until the batch is on disk; if it will not
+            // go, stop rather than answer for confirms we may lose
+            for (tries = 1; append_batch(batch) != 0; tries++)
+            {
+                if (tries == LOG_RETRIES)
+                {
+                    fprintf(stderr, "seats.wal: cannot log seat changes, stopping\n");
+                    exit(-1);
+                }
+                sleep(1);
+            }
+            for (i = 0; i < batch->length; i++)
+                logged_seats[batch->records[i].seat] = batch->records[i].word;
+
+            lsn = batch->records[batch->length - 1].lsn;
+            logged += batch->length;
+            batch->length = 0;
+
+            pthread_mutex_lock(&log_lock);
+            durable_lsn = lsn;
+            pthread_cond_broadcast(&log_durable);
+            pthread_mutex_unlock(&log_lock);
+        }
+
+        // the file holds exactly the records up to durable_lsn, so the
+        // snapshot can take their place
+        if (done || logged >= SNAPSHOT_RECORDS ||
+            (logged > 0 && time(NULL) - last_snapshot >= SNAPSHOT_SECONDS))
+        {
+            pthread_mutex_lock(&log_lock);
+            lsn = durable_lsn;
+            pthread_mutex_unlock(&log_lock);
+            if (write_snapshot(lsn) == 0)
+            {
+                logged = 0;
+                last_snapshot = time(NULL);
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Write a batch after the records already logged and sync it. A failed
+ * attempt is cut off again so that it leaves no torn record for the next
+ * batch to follow: replay stops at the first one.
+ */
+static int append_batch(log_batch_t* batch)
+{
+    size_t size = sizeof(log_record_t) * batch->length;
+    char* p = (char*) batch->records;
+    ssize_t n;
+
+    while (size > 0 && ((n = write(log_fd, p, size)) > 0 || errno == EINTR))
+    {
+        if (n > 0)
+        {
+            p += n;
+            size -= n;
+        }
+    }
+    if (size == 0 && fdatasync(log_fd) == 0)
+    {
+        log_end += sizeof(log_record_t) * batch->length;
+        return 0;
+    }
+
+    perror("seats.wal");
+    if (ftruncate(log_fd, log_end) != 0)
+    {
+        perror("seats.wal");
+        exit(-1);
+    }
+    return -1;
+}
+
+/*
+ * Copy the logged seats into a new snapshot through a shared mapping, make
+ * it durable, put it in place of the old one, then empty the log. Only
+ * this thread writes the logged seats, and it has applied every record up
+ * to lsn and none after, so the snapshot is exactly the log up to lsn.
+ */
+static int write_snapshot(long lsn)
+{
+    size_t size = sizeof(snapshot_header_t) + sizeof(uint64_t) * log_seat_count;
+    snapshot_header_t* header;
+    uint64_t* words;
+    void* map;
+    int fd, i;
+
+    fd = open(snapshot_tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, size) != 0)
+    {
+        perror("seats.snap");
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+    {
+        perror("seats.snap");
+        close(fd);
+        return -1;
+    }
+
+    header = (snapshot_header_t*) map;
+    words = (uint64_t*) (header + 1);
+    memcpy(words, logged_seats, sizeof(uint64_t) * log_seat_count);
+    header->lsn = lsn;
+    header->seat_count = log_seat_count;
+    header->venue_count = log_venue_count;
+    header->venue_seats = log_venue_seats;
+    memcpy(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic));
+
+    i = msync(map, size, MS_SYNC);
+    munmap(map, size);
+    close(fd);
+    if (i != 0 || rename(snapshot_tmp_path, snapshot_path) != 0 || fsync(dir_fd) != 0)
+    {
+        perror("seats.snap");
+        return -1;
+    }
+
+    // all but the layout record; records left behind are all covered by
+    // the snapshot, so a log that will not empty is still good to append to
+    if (ftruncate(log_fd, sizeof(log_record_t)) == 0)
+        log_end = sizeof(log_record_t);
+    if (log_end != sizeof(log_record_t) || fdatasync(log_fd) != 0)
+        perror("seats.wal");
+    return 0;
+}
+
+/*
+ * The seat array as of the last snapshot, mapped privately and used in
+ * place: pages are read in as they are touched and copied only when
+ * written. A snapshot of other venues would put every seat in the wrong
+ * place, so we refuse to start on one.
+ */
+static uint64_t* map_snapshot(int seat_count, uint64_t empty_word, long* lsn)
+{
+    size_t size = sizeof(snapshot_header_t) + sizeof(uint64_t) * seat_count;
+    snapshot_header_t* header;
+    uint64_t* seats;
+    struct stat st;
+    void* map;
+    int fd, i;
+
+    *lsn = 0;
+    fd = open(snapshot_path, O_RDONLY);
+    if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size >= sizeof(snapshot_header_t))
+    {
+        map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED)
+        {
+            header = (snapshot_header_t*) map;
+            if (memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0 ||
+                st.st_size != sizeof(snapshot_header_t) + sizeof(uint64_t) * header->seat_count)
+            {
+                fprintf(stderr, "seats.snap: not a snapshot, ignored\n");
+                munmap(map, st.st_size);
+            }
+            else if (header->venue_count != log_venue_count || header->venue_seats != log_venue_seats ||
+                     st.st_size != size)
+            {
+                fprintf(stderr, "seats.snap: kept for %u venues of %u seats, not %d of %d\n",
+                        header->venue_count, header->venue_seats, log_venue_count, log_venue_seats);
+                exit(-1);
+            }
+            else
+            {
+                close(fd);
+                *lsn = header->lsn;
+                snapshot_map = map;
+                snapshot_map_size = size;
+                return (uint64_t*) (header + 1);
+            }
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+
+    seats = (uint64_t*) malloc(sizeof(uint64_t) * (seat_count > 0 ? seat_count : 1));
+    for (i = 0; i < seat_count; i++)
+        seats[i] = empty_word;
+    return seats;
+}
+
+/*
+ * Apply the records logged after the snapshot. The log ends at the first
+ * record that does not check out, which is cut off: a crash can leave a
+ * partly written batch, but never one that was reported durable. The
+ * first record gives the layout, as the snapshot header does, and is
+ * written if the log does not have it yet. Returns the last sequence
+ * number in use.
+ */
+static long replay_log(long snapshot_lsn)
+{
+    log_record_t record, layout;
+    long lsn = snapshot_lsn;
+    off_t good = sizeof(record);
+
+    layout_record(&layout);
+    lseek(log_fd, 0, SEEK_SET);
+    if (read(log_fd, &record, sizeof(record)) != sizeof(record) || record.check != record_check(&record))
+    {
+        if (ftruncate(log_fd, 0) != 0 || write(log_fd, &layout, sizeof(layout)) != sizeof(layout) ||
+            fdatasync(log_fd) != 0)
+        {
+            perror("seats.wal");
+            exit(-1);
+        }
+        log_end = good;
+        return lsn;
+    }
+    if (memcmp(&record, &layout, sizeof(record)) != 0)
+    {
+        fprintf(stderr, "seats.wal: kept for %u venues of %u seats, not %d of %d\n",
+                record.seat == LAYOUT_SEAT ? (unsigned) (record.word >> 32) : 0,
+                record.seat == LAYOUT_SEAT ? (unsigned) record.word : 0, log_venue_count, log_venue_seats);
+        exit(-1);
+    }
+
+    while (read(log_fd, &record, sizeof(record)) == sizeof(record) && record.check == record_check(&record))
+    {
+        if (record.lsn > snapshot_lsn && record.seat < log_seat_count)
+            log_seats[record.seat] = record.word;
+        if (record.lsn > lsn)
+            lsn = record.lsn;
+        good += sizeof(record);
+    }
+    if (ftruncate(log_fd, good) != 0)
+    {
+        perror("seats.wal");
+        exit(-1);
+    }
+    log_end = good;
+    return lsn;
+}
+
+// sequence number 0 and no seat, with the venue count and seats a venue
+static void layout_record(log_record_t* record)
+{
+    memset(record, 0, sizeof(*record));
+    record->word = (uint64_t) log_venue_count << 32 | (uint32_t) log_venue_seats;
+    record->seat = LAYOUT_SEAT;
+    record->check = record_check(record);
+}
+
+// FNV-1a over the rest of the record
+static uint32_t record_check(log_record_t* record)
+{
+    unsigned char* p = (unsigned char*) record;
+    uint32_t h = 2166136261u;
+    int i;
+
+    for (i = 0; i < offsetof(log_record_t, check); i++)
+        h = (h ^ p[i]) * 16777619u;
+    return h;
+}
+
+static char* join_path(char* dir, char* name)
+{
+    char* path = (char*) malloc(strlen(dir) + strlen(name) + 2);
+    sprintf(path, "%s/%s", dir, name);
+    return path;
+}
@@ -0,0 +1,16 @@
+#ifndef _SEAT_LOG_H_
+#define _SEAT_LOG_H_
+
+#include <stdint.h>
+
+/*
+ * Durable seat state: a write-ahead log of seat words plus a snapshot of
+ * the whole seat array. The log treats words as opaque; what they mean is
+ * up to seats.c.
+ */
+uint64_t* seat_log_open(char* dir, int venue_count, int venue_seats, int seat_count, uint64_t empty_word);
+long seat_log_append(int seat_id, uint64_t word);
+void seat_log_wait(long lsn);
+void seat_log_close();
+
+#endif
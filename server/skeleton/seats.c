@@ -1,155 +1,494 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
+#include <time.h>
 
 #include "seats.h"
+#include "timer_wheel.h"
+#include "seat_log.h"
 
-seat_t* seat_header = NULL;
+#define HOLD_TICK_MS 100
+
+/*
+ * Each seat is one 64-bit word indexed by id: the customer in the low 32
+ * bits, the state in the next two and a hold count in the rest. Every
+ * transition is a compare-and-swap on that word, so no seat operation ever
+ * waits on a lock and list_seats reads each seat with a single load.
+ *
+ * The hold count goes up every time a seat becomes PENDING, so a word
+ * names one particular hold and an expiry meant for an earlier one can
+ * never release a later one.
+ */
+#define SEAT_WORD(state, customer, holds) (((uint64_t) (holds) << 34) | \
+        ((uint64_t) (state) << 32) | (uint32_t) (customer))
+#define SEAT_STATE(word) ((seat_state_t) (((word) >> 32) & 3))
+#define SEAT_CUSTOMER(word) ((int) (uint32_t) (word))
+#define SEAT_HOLDS(word) ((word) >> 34)
+#define SEAT_HELD_BY(word, customer) (SEAT_STATE(word) == PENDING && SEAT_CUSTOMER(word) == (customer))
+
+/*
+ * Venues (flights, events) are shards: each has its own seats, listing
+ * and version, and shares nothing with another that a request touches.
+ * Their seat words lie end to end in one array, each venue's padded to a
+ * whole number of cache lines, so a seat also has a global index (the
+ * venue's base plus its id) that names its hold timer and its log record.
+ */
+typedef struct venue_t
+{
+    uint64_t* seats;
+    int base;
+
+    /*
+     * list_seats is answered from a listing rendered once at load time,
+     * "0 A,1 A,...\n". Seat id's state letter sits at listing_offsets[id];
+     * every transition patches that one byte and bumps listing_version, so
+     * a poll costs no rendering and a client that already has the current
+     * version can be told nothing changed.
+     */
+    char* listing;
+    int listing_length;
+    int* listing_offsets;
+    unsigned long listing_version;
+
+    /*
+     * The same listing packed at two bits a seat, three seats to a base64
+     * character, after a "count:" prefix: some twenty times smaller than the
+     * text and still safe to hand to a browser as text. It is patched
+     * alongside the text listing and shares its version.
+     */
+    char* packed;
+    int packed_length;
+    int packed_start;
+
+    // keeps the next venue's version off this one's cache line
+    char pad[64];
+} venue_t;
+
+#define SEAT_STRIDE(count) (((count) + 7) & ~7)
+
+static uint64_t* seat_words = NULL;
+static venue_t* venues = NULL;
+static int seat_stride = 0;
+
+// seats per venue, and how many venues
+int seat_count = 0;
+int venue_count = 1;
+
+// seconds a PENDING seat is held before it is released, 0 for forever
+int hold_ttl = 300;
+
+/*
+ * Directory seats are kept in across restarts, NULL to keep them in
+ * memory only. Only confirmations are logged: a hold does not survive a
+ * restart, so a seat that was PENDING comes back AVAILABLE, and a
+ * confirmation is not answered until it is on disk.
+ */
+char* seat_store_dir = NULL;
+static int seats_logged = 0;
+
+/*
+ * One timer per seat, by global index, armed while the seat is PENDING.
+ * The wheel's thread releases a hold whose timer fires.
+ */
+static timer_wheel_t* hold_wheel = NULL;
+static wheel_timer_t* hold_timers = NULL;
+
+static const char packed_digits[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+static signed char packed_values[256];
 
 char seat_state_to_char(seat_state_t);
 
-void list_seats(char* buf, int bufsize)
+static venue_t* find_venue(int venue_id);
+static uint64_t load_seat(venue_t* v, int seat_id);
+static int swap_seat(venue_t* v, int seat_id, uint64_t* old, uint64_t word);
+static void seat_changed(venue_t* v, int seat_id);
+static void sync_hold_timer(venue_t* v, int seat_id);
+static void patch_listing(venue_t* v, int seat_id);
+static void patch_packed(venue_t* v, int seat_id, seat_state_t state);
+static void render_listing(venue_t* v);
+static void expire_hold(wheel_timer_t* timer, uint64_t word);
+static int sort_seat_ids(int* seat_ids, int count);
+static int claim_seats(venue_t* v, int* seat_ids, int count, int customer_id,
+        int (*step)(uint64_t old, int customer_id, uint64_t* word));
+static int hold_step(uint64_t old, int customer_id, uint64_t* word);
+static int confirm_step(uint64_t old, int customer_id, uint64_t* word);
+static int cancel_step(uint64_t old, int customer_id, uint64_t* word);
+static int print_seat_ids(char* buf, int bufsize, int* seat_ids, int count);
+
+/*
+ * Point *buf at the venue's current listing and return its length, or -1
+ * if there is no such venue. The listing belongs to the seat store and may
+ * be patched while it is being sent; *version is read first, so anything
+ * patched after it was read shows up as a newer version.
+ */
+int list_seats(int venue_id, char** buf, unsigned long* version)
+{
+    venue_t* v = find_venue(venue_id);
+
+    if (v == NULL)
+        return -1;
+    *version = __atomic_load_n(&v->listing_version, __ATOMIC_ACQUIRE);
+    *buf = v->listing;
+    return v->listing_length;
+}
+
+// the packed listing, on the same terms as list_seats
+int list_seats_packed(int venue_id, char** buf, unsigned long* version)
+{
+    venue_t* v = find_venue(venue_id);
+
+    if (v == NULL)
+        return -1;
+    *version = __atomic_load_n(&v->listing_version, __ATOMIC_ACQUIRE);
+    *buf = v->packed;
+    return v->packed_length;
+}
+
+/*
+ * The listing as runs of one state, "A120P2A30O8": a state letter then how
+ * many seats in a row are in it. It is written to buf if it fits in size
+ * bytes, NUL included. Returns its length either way, so a caller whose
+ * buffer was too small can try again with a bigger one, or -1 if there is
+ * no such venue.
+ */
+int list_seats_rle(int venue_id, char* buf, int size, unsigned long* version)
 {
-    seat_t* curr = seat_header;
-    int index = 0;
-    while(curr != NULL && index < bufsize+ strlen("%d %c,"))
+    venue_t* v = find_venue(venue_id);
+    char state = 0, next;
+    char run_text[16];
+    int id, run = 0, n = 0, k;
+
+    if (v == NULL)
+        return -1;
+    *version = __atomic_load_n(&v->listing_version, __ATOMIC_ACQUIRE);
+    for (id = 0; id <= seat_count; id++)
     {
-        int length = snprintf(buf+index, bufsize-index, 
-                "%d %c,", curr->id, seat_state_to_char(curr->state));
-        if (length > 0)
-            index = index + length;
-        curr = curr->next;
+        next = id < seat_count ? seat_state_to_char(SEAT_STATE(load_seat(v, id))) : 0;
+        if (next == state)
+        {
+            run++;
+            continue;
+        }
+        if (run > 0)
+        {
+            k = sprintf(run_text, "%c%d", state, run);
+            if (n + k < size)
+                memcpy(buf + n, run_text, k);
+            n += k;
+        }
+        state = next;
+        run = 1;
     }
-    if (index > 0)
-        snprintf(buf+index-1, bufsize-index-1, "\n");
-    else
-        snprintf(buf, bufsize, "No seats not found\n\n");
+    if (n + 1 < size)
+    {
+        buf[n] = '\n';
+        buf[n + 1] = '\0';
+    }
+    return n + 1;
 }
 
-void view_seat(char* buf, int bufsize,  int seat_id, int customer_id, int customer_priority)
+void view_seat(char* buf, int bufsize, int venue_id, int seat_id, int customer_id, int customer_priority)
 {
-    seat_t* curr = seat_header;
-    while(curr != NULL)
+    venue_t* v = find_venue(venue_id);
+    uint64_t old;
+
+    if (v == NULL)
     {
-        if(curr->id == seat_id)
-        {
-            if(curr->state == AVAILABLE || (curr->state == PENDING && curr->customer_id == customer_id))
-            {
-                snprintf(buf, bufsize, "Confirm seat: %d %c ?\n\n",
-                        curr->id, seat_state_to_char(curr->state));
-                curr->state = PENDING;
-                curr->customer_id = customer_id;
-            }
-            else
-            {
-                snprintf(buf, bufsize, "Seat unavailable\n\n");
-            }
+        snprintf(buf, bufsize, "Requested venue not found\n\n");
+        return;
+    }
+    if (seat_id < 0 || seat_id >= seat_count)
+    {
+        snprintf(buf, bufsize, "Requested seat not found\n\n");
+        return;
+    }
 
+    old = load_seat(v, seat_id);
+    while(SEAT_STATE(old) == AVAILABLE || SEAT_HELD_BY(old, customer_id))
+    {
+        // viewing a seat we already hold only restarts its timer
+        if(SEAT_STATE(old) == PENDING ||
+           swap_seat(v, seat_id, &old, SEAT_WORD(PENDING, customer_id, SEAT_HOLDS(old) + 1)))
+        {
+            seat_changed(v, seat_id);
+            snprintf(buf, bufsize, "Confirm seat: %d %c ?\n\n",
+                    seat_id, seat_state_to_char(SEAT_STATE(old)));
             return;
         }
-        curr = curr->next;
     }
-    snprintf(buf, bufsize, "Requested seat not found\n\n");
-    return;
+    snprintf(buf, bufsize, "Seat unavailable\n\n");
 }
 
-void confirm_seat(char* buf, int bufsize, int seat_id, int customer_id, int customer_priority)
+void confirm_seat(char* buf, int bufsize, int venue_id, int seat_id, int customer_id, int customer_priority)
 {
-    seat_t* curr = seat_header;
-    while(curr != NULL)
+    venue_t* v = find_venue(venue_id);
+    uint64_t old;
+
+    if (v == NULL)
     {
-        if(curr->id == seat_id)
-        {
-            if(curr->state == PENDING && curr->customer_id == customer_id )
-            {
-                snprintf(buf, bufsize, "Seat confirmed: %d %c\n\n",
-                        curr->id, seat_state_to_char(curr->state));
-                curr->state = OCCUPIED;
-            }
-            else if(curr->customer_id != customer_id )
-            {
-                snprintf(buf, bufsize, "Permission denied - seat held by another user\n\n");
-            }
-            else if(curr->state != PENDING)
-            {
-                snprintf(buf, bufsize, "No pending request\n\n");
-            }
+        snprintf(buf, bufsize, "Requested venue not found\n\n");
+        return;
+    }
+    if (seat_id < 0 || seat_id >= seat_count)
+    {
+        snprintf(buf, bufsize, "Requested seat not found\n\n");
+        return;
+    }
 
+    old = load_seat(v, seat_id);
+    while(SEAT_HELD_BY(old, customer_id))
+    {
+        if(swap_seat(v, seat_id, &old, SEAT_WORD(OCCUPIED, customer_id, SEAT_HOLDS(old))))
+        {
+            seat_changed(v, seat_id);
+            if (seats_logged)
+                seat_log_wait(seat_log_append(v->base + seat_id, SEAT_WORD(OCCUPIED, customer_id, SEAT_HOLDS(old))));
+            snprintf(buf, bufsize, "Seat confirmed: %d %c\n\n",
+                    seat_id, seat_state_to_char(PENDING));
             return;
         }
-        curr = curr->next;
     }
-    snprintf(buf, bufsize, "Requested seat not found\n\n");
-    
-    return;
+
+    if(SEAT_CUSTOMER(old) != customer_id )
+    {
+        snprintf(buf, bufsize, "Permission denied - seat held by another user\n\n");
+    }
+    else
+    {
+        snprintf(buf, bufsize, "No pending request\n\n");
+    }
 }
 
-void cancel(char* buf, int bufsize, int seat_id, int customer_id, int customer_priority)
+void cancel(char* buf, int bufsize, int venue_id, int seat_id, int customer_id, int customer_priority)
 {
+    venue_t* v = find_venue(venue_id);
+    uint64_t old;
+
     printf("Cancelling seat %d for user %d\n", seat_id, customer_id);
 
-    seat_t* curr = seat_header;
-    while(curr != NULL)
+    if (v == NULL)
     {
-        if(curr->id == seat_id)
-        {
-            if(curr->state == PENDING && curr->customer_id == customer_id )
-            {
-                snprintf(buf, bufsize, "Seat request cancelled: %d %c\n\n",
-                        curr->id, seat_state_to_char(curr->state));
-                curr->state = AVAILABLE;
-            }
-            else if(curr->customer_id != customer_id )
-            {
-                snprintf(buf, bufsize, "Permission denied - seat held by another user\n\n");
-            }
-            else if(curr->state != PENDING)
-            {
-                snprintf(buf, bufsize, "No pending request\n\n");
-            }
+        snprintf(buf, bufsize, "Venue not found\n\n");
+        return;
+    }
+    if (seat_id < 0 || seat_id >= seat_count)
+    {
+        snprintf(buf, bufsize, "Seat not found\n\n");
+        return;
+    }
 
+    old = load_seat(v, seat_id);
+    while(SEAT_HELD_BY(old, customer_id))
+    {
+        // the customer stays recorded, as it always has
+        if(swap_seat(v, seat_id, &old, SEAT_WORD(AVAILABLE, customer_id, SEAT_HOLDS(old))))
+        {
+            seat_changed(v, seat_id);
+            snprintf(buf, bufsize, "Seat request cancelled: %d %c\n\n",
+                    seat_id, seat_state_to_char(PENDING));
             return;
         }
-        curr = curr->next;
     }
-    snprintf(buf, bufsize, "Seat not found\n\n");
-    
-    return;
+
+    if(SEAT_CUSTOMER(old) != customer_id )
+    {
+        snprintf(buf, bufsize, "Permission denied - seat held by another user\n\n");
+    }
+    else
+    {
+        snprintf(buf, bufsize, "No pending request\n\n");
+    }
+}
+
+/*
+ * Group bookings: hold, confirm or cancel several seats at once, all or
+ * nothing. The seats are taken in ascending id order, so two overlapping
+ * groups meet at their lowest shared seat and one of them wins, instead of
+ * each grabbing part of what the other needs. If one seat cannot be
+ * taken, those already taken are put back as they were, so a failed
+ * confirm briefly shows seats OCCUPIED that go back to PENDING; only a
+ * group that succeeds is logged. Nothing stops another request seeing
+ * the seats in between and being refused for one that ends up free
+ * (see seats.h). seat_ids is sorted in place.
+ */
+void view_seats(char* buf, int bufsize, int venue_id, int* seat_ids, int count, int customer_id, int customer_priority)
+{
+    venue_t* v = find_venue(venue_id);
+    int n, failed;
+
+    if (v == NULL)
+    {
+        snprintf(buf, bufsize, "Requested venue not found\n\n");
+        return;
+    }
+    if ((count = sort_seat_ids(seat_ids, count)) < 0)
+    {
+        snprintf(buf, bufsize, "Requested seat not found\n\n");
+        return;
+    }
+    failed = claim_seats(v, seat_ids, count, customer_id, hold_step);
+    if (failed >= 0)
+    {
+        snprintf(buf, bufsize, "Seat unavailable: %d\n\n", failed);
+        return;
+    }
+    n = snprintf(buf, bufsize, "Confirm seats: ");
+    n += print_seat_ids(buf + n, bufsize - n, seat_ids, count);
+    snprintf(buf + n, bufsize - n, " ?\n\n");
 }
 
+void confirm_seats(char* buf, int bufsize, int venue_id, int* seat_ids, int count, int customer_id, int customer_priority)
+{
+    venue_t* v = find_venue(venue_id);
+    int i, n, failed;
+    long lsn = 0;
+
+    if (v == NULL)
+    {
+        snprintf(buf, bufsize, "Requested venue not found\n\n");
+        return;
+    }
+    if ((count = sort_seat_ids(seat_ids, count)) < 0)
+    {
+        snprintf(buf, bufsize, "Requested seat not found\n\n");
+        return;
+    }
+    failed = claim_seats(v, seat_ids, count, customer_id, confirm_step);
+    if (failed >= 0)
+    {
+        if (SEAT_CUSTOMER(load_seat(v, failed)) != customer_id)
+            snprintf(buf, bufsize, "Permission denied - seat %d held by another user\n\n", failed);
+        else
+            snprintf(buf, bufsize, "No pending request for seat %d\n\n", failed);
+        return;
+    }
+    if (seats_logged)
+    {
+        // only the request that made a seat OCCUPIED ever puts it back,
+        // when the rest of its group fails, so once the whole group is
+        // ours the words read back are the ones just set
+        for (i = 0; i < count; i++)
+            lsn = seat_log_append(v->base + seat_ids[i], load_seat(v, seat_ids[i]));
+        seat_log_wait(lsn);
+    }
+    n = snprintf(buf, bufsize, "Seats confirmed: ");
+    n += print_seat_ids(buf + n, bufsize - n, seat_ids, count);
+    snprintf(buf + n, bufsize - n, "\n\n");
+}
+
+void cancel_seats(char* buf, int bufsize, int venue_id, int* seat_ids, int count, int customer_id, int customer_priority)
+{
+    venue_t* v = find_venue(venue_id);
+    int n, failed;
+
+    if (v == NULL)
+    {
+        snprintf(buf, bufsize, "Venue not found\n\n");
+        return;
+    }
+    if ((count = sort_seat_ids(seat_ids, count)) < 0)
+    {
+        snprintf(buf, bufsize, "Seat not found\n\n");
+        return;
+    }
+    failed = claim_seats(v, seat_ids, count, customer_id, cancel_step);
+    if (failed >= 0)
+    {
+        if (SEAT_CUSTOMER(load_seat(v, failed)) != customer_id)
+            snprintf(buf, bufsize, "Permission denied - seat %d held by another user\n\n", failed);
+        else
+            snprintf(buf, bufsize, "No pending request for seat %d\n\n", failed);
+        return;
+    }
+    n = snprintf(buf, bufsize, "Seat requests cancelled: ");
+    n += print_seat_ids(buf + n, bufsize - n, seat_ids, count);
+    snprintf(buf + n, bufsize - n, "\n\n");
+}
+
+/*
+ * Set up venue_count venues of number_of_seats seats each, recovering
+ * them from seat_store_dir if it is set.
+ */
 void load_seats(int number_of_seats)
 {
-    seat_t* curr = NULL;
-    int i;
-    for(i = 0; i < number_of_seats; i++)
-    {   
-        seat_t* temp = (seat_t*) malloc(sizeof(seat_t));
-        temp->id = i;
-        temp->customer_id = -1;
-        temp->state = AVAILABLE;
-        temp->next = NULL;
-        
-        if (seat_header == NULL)
+    int i, total;
+
+    if (number_of_seats < 0)
+        number_of_seats = 0;
+    if (venue_count < 1)
+        venue_count = 1;
+    seat_count = number_of_seats;
+    seat_stride = SEAT_STRIDE(number_of_seats);
+    total = seat_stride * venue_count;
+
+    if (seat_store_dir != NULL)
+    {
+        seat_words = seat_log_open(seat_store_dir, venue_count, seat_count, total, SEAT_WORD(AVAILABLE, -1, 0));
+        seats_logged = 1;
+        for(i = 0; i < total; i++)
         {
-            seat_header = temp;
+            if (SEAT_STATE(seat_words[i]) == PENDING)
+                seat_words[i] = SEAT_WORD(AVAILABLE, SEAT_CUSTOMER(seat_words[i]), SEAT_HOLDS(seat_words[i]));
         }
-        else
+    }
+    else
+    {
+        seat_words = (uint64_t*) malloc(sizeof(uint64_t) * (total > 0 ? total : 1));
+        for(i = 0; i < total; i++)
+        {   
+            seat_words[i] = SEAT_WORD(AVAILABLE, -1, 0);
+        }
+    }
+
+    if (hold_ttl > 0)
+    {
+        hold_timers = (wheel_timer_t*) malloc(sizeof(wheel_timer_t) * (total > 0 ? total : 1));
+        for(i = 0; i < total; i++)
         {
-            curr-> next = temp;
+            timer_wheel_init_timer(&hold_timers[i]);
         }
-        curr = temp;
+        hold_wheel = timer_wheel_create(HOLD_TICK_MS, expire_hold);
+    }
+
+    for (i = 0; i < sizeof(packed_digits) - 1; i++)
+        packed_values[(unsigned char) packed_digits[i]] = i;
+    venues = (venue_t*) calloc(venue_count, sizeof(venue_t));
+    for (i = 0; i < venue_count; i++)
+    {
+        venues[i].base = i * seat_stride;
+        venues[i].seats = seat_words + venues[i].base;
+        render_listing(&venues[i]);
     }
 }
 
 void unload_seats()
 {
-    seat_t* curr = seat_header;
-    while(curr != NULL)
+    int i;
+
+    if (hold_wheel != NULL)
     {
-        seat_t* temp = curr;
-        curr = curr->next;
-        free(temp);
+        timer_wheel_destroy(hold_wheel);
+        hold_wheel = NULL;
     }
+    for (i = 0; i < venue_count && venues != NULL; i++)
+    {
+        free(venues[i].listing);
+        free(venues[i].listing_offsets);
+        free(venues[i].packed);
+    }
+    free(venues);
+    free(hold_timers);
+    if (seats_logged)
+        seat_log_close();
+    else
+        free(seat_words);
+    seats_logged = 0;
+    seat_count = 0;
+    venues = NULL;
+    hold_timers = NULL;
+    seat_words = NULL;
 }
 
 char seat_state_to_char(seat_state_t state)
@@ -166,3 +505,264 @@ char seat_state_to_char(seat_state_t state)
 
     return '?';
 }
+
+static venue_t* find_venue(int venue_id)
+{
+    if (venue_id < 0 || venue_id >= venue_count)
+        return NULL;
+    return &venues[venue_id];
+}
+
+static uint64_t load_seat(venue_t* v, int seat_id)
+{
+    return __atomic_load_n(&v->seats[seat_id], __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Replace the seat's word if it still holds *old. On failure *old is
+ * updated to what the seat holds now, ready for the caller to re-check.
+ */
+static int swap_seat(venue_t* v, int seat_id, uint64_t* old, uint64_t word)
+{
+    return __atomic_compare_exchange_n(&v->seats[seat_id], old, word, 0,
+            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+// after a successful transition, bring the timer and the listing up to date
+static void seat_changed(venue_t* v, int seat_id)
+{
+    sync_hold_timer(v, seat_id);
+    patch_listing(v, seat_id);
+}
+
+/*
+ * Sort ids ascending and drop repeats. Returns the new count, or -1 if an
+ * id is out of range.
+ */
+static int sort_seat_ids(int* seat_ids, int count)
+{
+    int i, j, id, n = 0;
+
+    for (i = 0; i < count; i++)
+    {
+        if (seat_ids[i] < 0 || seat_ids[i] >= seat_count)
+            return -1;
+        // insertion sort: groups are a handful of seats
+        id = seat_ids[i];
+        for (j = n; j > 0 && seat_ids[j - 1] > id; j--)
+            seat_ids[j] = seat_ids[j - 1];
+        if (j > 0 && seat_ids[j - 1] == id)
+        {
+            for (; j < n; j++)
+                seat_ids[j] = seat_ids[j + 1];
+            continue;
+        }
+        seat_ids[j] = id;
+        n++;
+    }
+    return n;
+}
+
+/*
+ * Move every seat to the word step gives for it, in order. step returns 0
+ * if the seat may not be moved. On the first seat that cannot be, the
+ * seats already moved are swapped back and that seat's id is returned;
+ * -1 means all were moved. The old words are kept in a VLA since groups
+ * are small.
+ */
+static int claim_seats(venue_t* v, int* seat_ids, int count, int customer_id,
+        int (*step)(uint64_t old, int customer_id, uint64_t* word))
+{
+    uint64_t olds[count];
+    uint64_t words[count];
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        olds[i] = load_seat(v, seat_ids[i]);
+        while (step(olds[i], customer_id, &words[i]) &&
+               !swap_seat(v, seat_ids[i], &olds[i], words[i]))
+        {
+        }
+        if (!step(olds[i], customer_id, &words[i]))
+            break;
+    }
+
+    if (i < count)
+    {
+        int failed = seat_ids[i];
+        // only a word we put there is put back; if the seat has moved on
+        // since (a hold of ours expiring), it is left as it is
+        while (--i >= 0)
+        {
+            uint64_t ours = words[i];
+            swap_seat(v, seat_ids[i], &ours, olds[i]);
+            seat_changed(v, seat_ids[i]);
+        }
+        return failed;
+    }
+
+    for (i = 0; i < count; i++)
+        seat_changed(v, seat_ids[i]);
+    return -1;
+}
+
+// AVAILABLE, or already held by us (which only restarts the timer)
+static int hold_step(uint64_t old, int customer_id, uint64_t* word)
+{
+    if (SEAT_HELD_BY(old, customer_id))
+        *word = old;
+    else if (SEAT_STATE(old) == AVAILABLE)
+        *word = SEAT_WORD(PENDING, customer_id, SEAT_HOLDS(old) + 1);
+    else
+        return 0;
+    return 1;
+}
+
+static int confirm_step(uint64_t old, int customer_id, uint64_t* word)
+{
+    if (!SEAT_HELD_BY(old, customer_id))
+        return 0;
+    *word = SEAT_WORD(OCCUPIED, customer_id, SEAT_HOLDS(old));
+    return 1;
+}
+
+static int cancel_step(uint64_t old, int customer_id, uint64_t* word)
+{
+    if (!SEAT_HELD_BY(old, customer_id))
+        return 0;
+    *word = SEAT_WORD(AVAILABLE, customer_id, SEAT_HOLDS(old));
+    return 1;
+}
+
+static int print_seat_ids(char* buf, int bufsize, int* seat_ids, int count)
+{
+    int i, n = 0;
+
+    for (i = 0; i < count && n < bufsize; i++)
+        n += snprintf(buf + n, bufsize - n, i > 0 ? ",%d" : "%d", seat_ids[i]);
+    return n < bufsize ? n : bufsize - 1;
+}
+
+/*
+ * Make the seat's timer agree with the seat: armed for the current hold if
+ * it is PENDING, disarmed otherwise. Another thread may change the seat
+ * while we are at the wheel, so we look again afterwards and repeat until
+ * the seat held still; whoever touches the wheel last leaves it right.
+ */
+static void sync_hold_timer(venue_t* v, int seat_id)
+{
+    wheel_timer_t* timer;
+    uint64_t word, now;
+
+    if (hold_wheel == NULL)
+        return;
+
+    timer = &hold_timers[v->base + seat_id];
+    now = load_seat(v, seat_id);
+    do
+    {
+        word = now;
+        if (SEAT_STATE(word) == PENDING)
+            timer_wheel_add(hold_wheel, timer, hold_ttl * 1000, word);
+        else
+            timer_wheel_cancel(hold_wheel, timer);
+        now = load_seat(v, seat_id);
+    } while (now != word);
+}
+
+/*
+ * Write the seat's letter into the listing, then bump the version. As with
+ * the timer, we repeat until the seat held still, so the last writer
+ * leaves the right letter.
+ */
+static void patch_listing(venue_t* v, int seat_id)
+{
+    uint64_t word, now;
+
+    now = load_seat(v, seat_id);
+    do
+    {
+        word = now;
+        __atomic_store_n(&v->listing[v->listing_offsets[seat_id]],
+                seat_state_to_char(SEAT_STATE(word)), __ATOMIC_RELAXED);
+        patch_packed(v, seat_id, SEAT_STATE(word));
+        __atomic_add_fetch(&v->listing_version, 1, __ATOMIC_RELEASE);
+        now = load_seat(v, seat_id);
+    } while (now != word);
+}
+
+/*
+ * Set the seat's two bits in its packed character. Neighbouring seats share
+ * the character, so it is swapped in whole.
+ */
+static void patch_packed(venue_t* v, int seat_id, seat_state_t state)
+{
+    char* p = &v->packed[v->packed_start + seat_id / 3];
+    int shift = (seat_id % 3) * 2;
+    char old = __atomic_load_n(p, __ATOMIC_RELAXED);
+    char word;
+
+    do
+    {
+        int value = packed_values[(unsigned char) old];
+        word = packed_digits[(value & ~(3 << shift)) | (state << shift)];
+    } while (!__atomic_compare_exchange_n(p, &old, word, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+/*
+ * Render the venue's listing, remembering where each state letter went.
+ * The version starts from the clock so that a client's version from
+ * before a restart does not match by chance.
+ */
+static void render_listing(venue_t* v)
+{
+    int id, n = 0, size = 1;
+
+    for (id = 0; id < seat_count; id++)
+        size += snprintf(NULL, 0, "%d ", id) + 2;
+    if (seat_count == 0)
+        size = sizeof("No seats not found\n\n");
+
+    v->listing = (char*) malloc(size);
+    v->listing_offsets = (int*) malloc(sizeof(int) * (seat_count > 0 ? seat_count : 1));
+    for (id = 0; id < seat_count; id++)
+    {
+        n += sprintf(v->listing + n, "%d ", id);
+        v->listing_offsets[id] = n;
+        v->listing[n++] = seat_state_to_char(SEAT_STATE(v->seats[id]));
+        v->listing[n++] = ',';
+    }
+    if (n > 0)
+        v->listing[n - 1] = '\n';
+    else
+        n = sprintf(v->listing, "No seats not found\n\n");
+    v->listing[n] = '\0';
+    v->listing_length = n;
+
+    v->packed = (char*) malloc(32 + (seat_count + 2) / 3);
+    v->packed_start = sprintf(v->packed, "%d:", seat_count);
+    v->packed_length = v->packed_start + (seat_count + 2) / 3;
+    memset(v->packed + v->packed_start, packed_digits[0], v->packed_length - v->packed_start);
+    for (id = 0; id < seat_count; id++)
+        patch_packed(v, id, SEAT_STATE(v->seats[id]));
+    v->packed[v->packed_length++] = '\n';
+    v->packed[v->packed_length] = '\0';
+    v->listing_version = (unsigned long) time(NULL) << 20;
+}
+
+/*
+ * Called on the wheel's thread when a hold has run its time. The swap only
+ * succeeds if the seat is still in exactly the hold the timer was armed
+ * for.
+ */
+static void expire_hold(wheel_timer_t* timer, uint64_t word)
+{
+    int index = timer - hold_timers;
+    venue_t* v = &venues[index / seat_stride];
+    int seat_id = index % seat_stride;
+
+    // the timer is already disarmed, and we may not touch the wheel here
+    if (swap_seat(v, seat_id, &word, SEAT_WORD(AVAILABLE, SEAT_CUSTOMER(word), SEAT_HOLDS(word))))
+        patch_listing(v, seat_id);
+}
@@ -8,21 +8,32 @@ typedef enum
     OCCUPIED
 } seat_state_t;
 
-typedef struct seat_struct
-{
-    int id;
-    int customer_id;
-    seat_state_t state;
-    struct seat_struct* next;
-} seat_t;
-
+extern int hold_ttl;
+extern char* seat_store_dir;
+extern int venue_count;
 
 void load_seats(int);
 void unload_seats();
 
-void list_seats(char* buf, int bufsize);
-void view_seat(char* buf, int bufsize, int seat_num, int customer_num, int customer_priority);
-void confirm_seat(char* buf, int bufsize, int seat_num, int customer_num, int customer_priority);
-void cancel(char* buf, int bufsize, int seat_num, int customer_num, int customer_priority);
+int list_seats(int venue, char** buf, unsigned long* version);
+int list_seats_packed(int venue, char** buf, unsigned long* version);
+int list_seats_rle(int venue, char* buf, int size, unsigned long* version);
+void view_seat(char* buf, int bufsize, int venue, int seat_num, int customer_num, int customer_priority);
+void confirm_seat(char* buf, int bufsize, int venue, int seat_num, int customer_num, int customer_priority);
+void cancel(char* buf, int bufsize, int venue, int seat_num, int customer_num, int customer_priority);
+
+// most seats one group request may name
+#define SEAT_BATCH_MAX 16
+
+/*
+ * A group succeeds or fails as a whole, but it is not isolated: while it
+ * is being taken, or put back after failing, others can see part of it.
+ * A request refused for a seat a failing group held only for that moment
+ * gets the same answer as for a seat that is really taken, and may find
+ * the seat free if it asks again.
+ */
+void view_seats(char* buf, int bufsize, int venue, int* seat_nums, int count, int customer_num, int customer_priority);
+void confirm_seats(char* buf, int bufsize, int venue, int* seat_nums, int count, int customer_num, int customer_priority);
+void cancel_seats(char* buf, int bufsize, int venue, int* seat_nums, int count, int customer_num, int customer_priority);
 
 #endif
@@ -0,0 +1,243 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "stats.h"
+
+/*
+ * Histograms are log-linear, as in HdrHistogram: values below 16 get a
+ * bucket each and every power of two above that is split into 16, so a
+ * bucket is never wider than 1/16 of its lower bound. 38 powers of two
+ * reach 2^41 microseconds, about 25 days; longer times count as that.
+ */
+#define SUB_BITS 4
+#define SUB_COUNT (1 << SUB_BITS)
+#define HIST_BUCKETS (38 * SUB_COUNT)
+#define HIST_MAX_VALUE ((1L << 41) - 1)
+
+/*
+ * One thread's numbers. Only the owning thread writes them, with plain
+ * relaxed loads and stores (no locked instructions); readers may see a
+ * value a moment old, which is all a statistic needs. A shard outlives its
+ * thread and is taken over by the next thread to start, so nothing
+ * recorded is lost when the pool retires a worker.
+ */
+typedef struct stats_shard_t
+{
+    struct stats_shard_t* next;
+    int in_use;
+    uint64_t counters[STAT_COUNTERS];
+    uint64_t sums[STAT_HISTOGRAMS];
+    uint64_t buckets[STAT_HISTOGRAMS][HIST_BUCKETS];
+} stats_shard_t;
+
+static stats_shard_t* shards = NULL;
+static pthread_key_t shard_key;
+static pthread_once_t shard_once = PTHREAD_ONCE_INIT;
+static __thread stats_shard_t* shard = NULL;
+
+static char* counter_names[STAT_COUNTERS] = {
+    "requests", "shed", "tasks", "steals", "parks", "threads_started", "threads_retired"
+};
+static char* histogram_names[STAT_HISTOGRAMS] = {
+    "queue_wait", "service", "list_seats", "view_seat", "confirm", "cancel", "static"
+};
+
+static stats_shard_t* my_shard();
+static void make_key();
+static void release_shard(void* arg);
+static void bump(uint64_t* p, uint64_t n);
+static int bucket_index(long value);
+static long bucket_high(int index);
+static void append(char* buf, int size, int* n, char* fmt, ...);
+
+void stats_count(int counter)
+{
+    bump(&my_shard()->counters[counter], 1);
+}
+
+void stats_record(int histogram, long usec)
+{
+    stats_shard_t* s = my_shard();
+
+    if (usec < 0)
+        usec = 0;
+    bump(&s->sums[histogram], usec);
+    bump(&s->buckets[histogram][bucket_index(usec)], 1);
+}
+
+long stats_now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/*
+ * Add up every shard and write the totals into buf, as "name value" lines
+ * or as JSON. Latencies are in microseconds; percentiles are the upper
+ * bound of the bucket they fall in. Returns the length written.
+ */
+int stats_render(char* buf, int size, int json)
+{
+    static uint64_t buckets[STAT_HISTOGRAMS][HIST_BUCKETS];
+    static pthread_mutex_t render_lock = PTHREAD_MUTEX_INITIALIZER;
+    static double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+    static char* quantile_names[] = { "p50", "p90", "p99", "p999" };
+    uint64_t counters[STAT_COUNTERS];
+    uint64_t sums[STAT_HISTOGRAMS];
+    stats_shard_t* s;
+    int i, h, b, q, n = 0;
+
+    // the totals are too big for a worker's stack, so renders take turns
+    pthread_mutex_lock(&render_lock);
+    memset(counters, 0, sizeof(counters));
+    memset(sums, 0, sizeof(sums));
+    memset(buckets, 0, sizeof(buckets));
+    for (s = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); s != NULL; s = s->next)
+    {
+        for (i = 0; i < STAT_COUNTERS; i++)
+            counters[i] += __atomic_load_n(&s->counters[i], __ATOMIC_RELAXED);
+        for (h = 0; h < STAT_HISTOGRAMS; h++)
+        {
+            sums[h] += __atomic_load_n(&s->sums[h], __ATOMIC_RELAXED);
+            for (b = 0; b < HIST_BUCKETS; b++)
+                buckets[h][b] += __atomic_load_n(&s->buckets[h][b], __ATOMIC_RELAXED);
+        }
+    }
+
+    append(buf, size, &n, json ? "{\"counters\":{" : "");
+    for (i = 0; i < STAT_COUNTERS; i++)
+    {
+        append(buf, size, &n, json ? "%s\"%s\":%lu" : "%s%s %lu\n",
+                json && i > 0 ? "," : "", counter_names[i], (unsigned long) counters[i]);
+    }
+    append(buf, size, &n, json ? "},\"latency_us\":{" : "");
+
+    for (h = 0; h < STAT_HISTOGRAMS; h++)
+    {
+        uint64_t count = 0, seen = 0;
+        long max = 0;
+
+        for (b = 0; b < HIST_BUCKETS; b++)
+        {
+            count += buckets[h][b];
+            if (buckets[h][b] > 0)
+                max = bucket_high(b);
+        }
+        append(buf, size, &n, json ? "%s\"%s\":{\"count\":%lu,\"mean\":%lu" : "%s%s_us count=%lu mean=%lu",
+                json && h > 0 ? "," : "", histogram_names[h],
+                (unsigned long) count, (unsigned long) (count > 0 ? sums[h] / count : 0));
+
+        for (q = 0, b = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++)
+        {
+            long value = 0;
+            if (count > 0)
+            {
+                // the first bucket by which the quantile's share has been seen
+                while (b < HIST_BUCKETS && seen + buckets[h][b] < quantiles[q] * count)
+                    seen += buckets[h][b++];
+                value = bucket_high(b < HIST_BUCKETS ? b : HIST_BUCKETS - 1);
+            }
+            append(buf, size, &n, json ? ",\"%s\":%ld" : " %s=%ld", quantile_names[q], value);
+        }
+        append(buf, size, &n, json ? ",\"max\":%ld}" : " max=%ld\n", max);
+    }
+    append(buf, size, &n, json ? "}}\n" : "");
+    pthread_mutex_unlock(&render_lock);
+    return n;
+}
+
+/*
+ * This thread's shard: one given up by a finished thread if there is one,
+ * otherwise a new one. Shards are only ever added to the list, so readers
+ * can walk it without a lock.
+ */
+static stats_shard_t* my_shard()
+{
+    stats_shard_t* s;
+    int free_shard;
+
+    if (shard != NULL)
+        return shard;
+
+    pthread_once(&shard_once, make_key);
+    for (s = __atomic_load_n(&shards, __ATOMIC_ACQUIRE); s != NULL; s = s->next)
+    {
+        free_shard = 0;
+        if (__atomic_compare_exchange_n(&s->in_use, &free_shard, 1, 0,
+                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+    if (s == NULL)
+    {
+        s = (stats_shard_t*) calloc(1, sizeof(stats_shard_t));
+        s->in_use = 1;
+        s->next = __atomic_load_n(&shards, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&shards, &s->next, s, 1,
+                    __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
+    }
+    pthread_setspecific(shard_key, s);
+    shard = s;
+    return s;
+}
+
+static void make_key()
+{
+    pthread_key_create(&shard_key, release_shard);
+}
+
+// thread exit: hand the shard, numbers and all, to the next thread
+static void release_shard(void* arg)
+{
+    stats_shard_t* s = (stats_shard_t*) arg;
+    __atomic_store_n(&s->in_use, 0, __ATOMIC_RELEASE);
+}
+
+static void bump(uint64_t* p, uint64_t n)
+{
+    __atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static int bucket_index(long value)
+{
+    int e;
+
+    if (value > HIST_MAX_VALUE)
+        value = HIST_MAX_VALUE;
+    if (value < SUB_COUNT)
+        return value;
+    e = 63 - __builtin_clzl(value);
+    return (e - SUB_BITS + 1) * SUB_COUNT + ((value >> (e - SUB_BITS)) & (SUB_COUNT - 1));
+}
+
+// the largest value that lands in bucket index
+static long bucket_high(int index)
+{
+    int e;
+    long mantissa;
+
+    if (index < SUB_COUNT)
+        return index;
+    e = index / SUB_COUNT + SUB_BITS - 1;
+    mantissa = index % SUB_COUNT + SUB_COUNT + 1;
+    return (mantissa << (e - SUB_BITS)) - 1;
+}
+
+static void append(char* buf, int size, int* n, char* fmt, ...)
+{
+    va_list ap;
+
+    if (*n >= size - 1)
+        return;
+    va_start(ap, fmt);
+    *n += vsnprintf(buf + *n, size - *n, fmt, ap);
+    va_end(ap);
+    if (*n > size - 1)
+        *n = size - 1;
+}
@@ -0,0 +1,37 @@
+#ifndef _STATS_H_
+#define _STATS_H_
+
+/*
+ * Counters and latency histograms. Each thread records into its own shard
+ * without locking; the shards are only added up when somebody asks.
+ */
+enum stat_counter
+{
+    STAT_REQUESTS,
+    STAT_SHED,
+    STAT_TASKS,
+    STAT_STEALS,
+    STAT_PARKS,
+    STAT_THREADS_STARTED,
+    STAT_THREADS_RETIRED,
+    STAT_COUNTERS
+};
+
+enum stat_histogram
+{
+    HIST_QUEUE_WAIT,
+    HIST_SERVICE,
+    HIST_LIST_SEATS,
+    HIST_VIEW_SEAT,
+    HIST_CONFIRM,
+    HIST_CANCEL,
+    HIST_STATIC,
+    STAT_HISTOGRAMS
+};
+
+void stats_count(int counter);
+void stats_record(int histogram, long usec);
+long stats_now_us();
+int stats_render(char* buf, int size, int json);
+
+#endif
@@ -7,6 +7,7 @@ from Queue import Queue
 
 successes = Queue()
 failures = Queue()
+etags = {} #last ETag each thread was sent
 
 def parse_trace(tracefile='1.trace'):
     
@@ -76,13 +77,24 @@ def run_correctness_trace(config, trace, host, port, _id=0):
     for i in range(num_requests):
         
         for req in trace:
+            #a line may start with the status expected instead of 200
+            status = 200
+            if req[:3].isdigit() and req[3:4] == ' ':
+                status, req = int(req[:3]), req[4:]
             if ' ' in req:
                 req, assertion = req.split(' ', 1)
             else:
                 assertion = None
                 #have http_request return a value
+            #path|Name:value sends a header; $etag in the value is the
+            #ETag of this thread's last response
+            headers = {}
+            if '|' in req:
+                req, header = req.split('|', 1)
+                name, value = header.split(':', 1)
+                headers[name] = value.replace('$etag', etags.get(_id, ''))
             http_request(host, port, req, float(config['sleeptime']), _id=_id,\
-            assertion=assertion)
+            assertion=assertion, status=status, headers=headers)
 def run_performance_trace(config, trace, host, port, _id=0):
     
     num_requests = int(config['requests'])
@@ -101,14 +113,23 @@ def http_request(host, port, obj, sleeptime=0.0, method='GET', **kwargs):
     if 'assertion' in kwargs:
         assertion = kwargs['assertion']
 
+    status = 200
+    if 'status' in kwargs:
+        status = kwargs['status']
+
+    headers = {}
+    if 'headers' in kwargs:
+        headers = kwargs['headers']
+
     start = time.time()
     try:
         conn = httplib.HTTPConnection(host, port)
         time.sleep(sleeptime)
-        conn.request(method, obj)
+        conn.request(method, obj, headers=headers)
 
         response = conn.getresponse()
         responseStr = response.read()        
+        etags[_id] = response.getheader('etag', '')
         conn.close()
 
         responseStr = responseStr.strip()
@@ -129,7 +150,7 @@ def http_request(host, port, obj, sleeptime=0.0, method='GET', **kwargs):
         return False
 
         
-    if response.status != 200:
+    if response.status != status:
         #failed request
         print obj, 'Failed Request with incorrect status: %s' % response.status
         failures.put(start)
@@ -1,9 +1,16 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <sched.h>
 #include <unistd.h>
+#include <time.h>
 
 #include "thread_pool.h"
+#include "stats.h"
 
 /**
  *  @struct threadpool_task
@@ -13,110 +20,413 @@
  *
  *  @var function Pointer to the function that will perform the task.
  *  @var argument Argument to be passed to the function.
+ *  @var enqueued When the task was queued, in microseconds.
  */
 
-#define MAX_THREADS 20
+#define MAX_THREADS 64
 #define STANDBY_SIZE 8
 #define TASK_QUEUE_SIZE 40
 
+/*
+ * The pool keeps STANDBY_SIZE workers and adds one (up to its ceiling)
+ * whenever the oldest queued task has waited POOL_GROW_WAIT_MS with nobody
+ * idle, at most once per POOL_GROW_WAIT_MS. Workers look when they add or
+ * take a task, and a monitor thread looks every POOL_GROW_WAIT_MS, since
+ * with every worker stuck in a slow task nothing else would. A worker
+ * above the standby count that has been parked for POOL_IDLE_MS exits.
+ */
+#define POOL_GROW_WAIT_MS 10
+#define POOL_IDLE_MS 10000
+
+/*
+ * Every POOL_AGING_MS a task waits counts as one level of priority, so a
+ * steady stream of high priority work cannot starve the lower levels.
+ */
+#define POOL_AGING_MS 100
+
+/*
+ * How many times a producer facing a full queue, or a worker facing an
+ * empty one, tries again before going to sleep.
+ */
+#define POOL_SPINS 64
+
+/*
+ * Work stealing mode: each worker owns a Chase-Lev deque of DEQUE_SIZE
+ * tasks. It pushes and pops at the bottom without locking; idle workers
+ * steal from the top of a random victim's deque with one CAS. Tasks from
+ * outside the pool go through the shared queue (the injection queue), from
+ * which a worker takes up to DEQUE_BATCH extra tasks at a time for others
+ * to steal.
+ */
+#define DEQUE_SIZE 256
+#define DEQUE_MASK (DEQUE_SIZE - 1)
+#define DEQUE_BATCH 8
+
+#define DEQUE_EMPTY 0
+#define DEQUE_OK 1
+#define DEQUE_ABORT 2
+
+#if defined(__i386__) || defined(__x86_64__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() __atomic_signal_fence(__ATOMIC_SEQ_CST)
+#endif
+
 typedef struct pool_task_t {
   void (*function)(void*);
   void *argument;
+  long enqueued;
 } pool_task_t;
 
+/*
+ * A slot of a ring. seq says whose turn it is: equal to the position for
+ * the producer that will fill it, position + 1 for the consumer that will
+ * empty it.
+ */
+typedef struct ring_cell_t {
+  long seq;
+  pool_task_t task;
+} ring_cell_t;
 
+/*
+ * One bounded multi-producer/multi-consumer ring per priority level, after
+ * Vyukov: producers claim a slot by CAS on tail and consumers by CAS on
+ * head, with no lock. head and tail are on their own cache lines so
+ * producers and consumers do not slow each other down.
+ */
+typedef struct pool_ring_t {
+  char pad0[64];
+  long head;
+  char pad1[64];
+  long tail;
+  char pad2[64];
+  ring_cell_t *cells;
+  long mask;
+} pool_ring_t;
+
+// worker slot states
+#define SLOT_FREE 0
+#define SLOT_RUNNING 1
+#define SLOT_EXITED 2
+
+/*
+ * One per thread the pool may run. The deque is only used in work
+ * stealing mode. top is written by thieves and bottom by the owner, so they
+ * are kept on separate cache lines. A slot whose thread has exited keeps
+ * its (empty) deque for the next thread to use it.
+ */
+typedef struct worker_t {
+  pool_t *pool;
+  pthread_t thread;
+  int state;
+  unsigned int seed;
+  char pad0[64];
+  long top;
+  char pad1[64];
+  long bottom;
+  char pad2[64];
+  pool_task_t tasks[DEQUE_SIZE];
+} worker_t;
+
+/*
+ * The lock and condition variables are only used to sleep and to start
+ * and stop threads: workers wait on parked when there is nothing to do,
+ * producers on removed when the ring they want is full.
+ */
 struct pool_t {
   pthread_mutex_t lock;
-  pthread_cond_t added;
+  pthread_cond_t parked;
   pthread_cond_t removed;
-  pthread_t *threads;
+  int min_threads;
+  int max_threads;
   int num_threads;
-  pool_task_t *queue;
-  int queue_size;
-  int head;
-  int length;
+  long last_grow;
+  pool_ring_t rings[POOL_PRIORITIES];
   int stop;
+  int flags;
+  worker_t *workers;
+  int sleepers;
+  int blocked;
+  int cpu;
+  pthread_t monitor;
 };
 
-static void* thread_do_work(void *pool);
+static void* thread_do_work(void *worker);
+static void* worker_do_work(void *worker);
+static void* monitor_queue(void *pool);
+static int push_own_task(pool_t *pool, pool_task_t *task);
+static void task_added(pool_t *pool, pool_ring_t *ring, pool_task_t *task);
+static int take_task(pool_t *pool, pool_task_t *task);
+static int take_injected(worker_t *self, pool_task_t *task);
+static int steal_task(worker_t *self, pool_task_t *task);
+static int park(worker_t *self);
+static void maybe_grow(pool_t *pool, long waited);
+static int start_worker(pool_t *pool);
+static void pin_worker(pool_t *pool, worker_t *worker);
+static int pool_empty(pool_t *pool);
+static void wake_one(pool_t *pool);
+static void wake_blocked(pool_t *pool);
+static void ring_init(pool_ring_t *ring, int size);
+static int ring_push(pool_ring_t *ring, pool_task_t *task);
+static int ring_pop(pool_ring_t *ring, pool_task_t *task);
+static long ring_head_enqueued(pool_ring_t *ring);
+static long ring_length(pool_ring_t *ring);
+static int deque_push(worker_t *worker, pool_task_t *task);
+static int deque_pop(worker_t *worker, pool_task_t *task);
+static int deque_steal(worker_t *worker, pool_task_t *task);
+static void run_task(pool_t *pool, pool_task_t *task);
 
 // FILE* f;
 
+// the worker running on this thread, so tasks it adds go to its own deque
+static __thread worker_t *current_worker = NULL;
+
 /*
  * Create a threadpool, initialize variables, etc
  *
+ * Starts STANDBY_SIZE workers and lets the pool grow to max_threads
+ * (MAX_THREADS if 0 or less). flags is 0 for a single shared queue, or
+ * POOL_WORK_STEALING. Each priority level holds queue_size tasks, rounded
+ * up to a power of two.
+ *
  */
-pool_t *pool_create(int queue_size, int num_threads)
+pool_t *pool_create(int queue_size, int max_threads, int flags)
 {
+  pthread_condattr_t attr;
   int i;
   // f = fopen("/Users/katsuya94/pool.log", "w");
-  if (num_threads > MAX_THREADS) num_threads = MAX_THREADS;
+  if (max_threads <= 0) max_threads = MAX_THREADS;
   pool_t* pool = (pool_t*) malloc(sizeof(pool_t));
   pthread_mutex_init(&pool->lock, NULL);
-  pthread_cond_init(&pool->added, NULL);
+  // parked workers time out against the monotonic clock
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&pool->parked, &attr);
+  pthread_condattr_destroy(&attr);
   pthread_cond_init(&pool->removed, NULL);
-  pool->threads = (pthread_t*) malloc(sizeof(pthread_t) * num_threads);
-  pool->num_threads = num_threads;
-  pool->queue = (pool_task_t*) malloc(sizeof(pool_task_t) * queue_size);
-  pool->queue_size = queue_size;
-  pool->head = 0;
-  pool->length = 0;
+  pool->min_threads = max_threads < STANDBY_SIZE ? max_threads : STANDBY_SIZE;
+  pool->max_threads = max_threads;
+  pool->num_threads = 0;
+  pool->last_grow = 0;
+  for (i = 0; i < POOL_PRIORITIES; i++) {
+    ring_init(&pool->rings[i], queue_size);
+  }
   pool->stop = 0;
-  for (i = 0; i < pool->num_threads; i++) {
-    if (pthread_create(&pool->threads[i], NULL, thread_do_work, pool) != 0) {
+  pool->flags = flags;
+  pool->sleepers = 0;
+  pool->blocked = 0;
+  pool->cpu = -1;
+  pool->workers = (worker_t*) calloc(max_threads, sizeof(worker_t));
+  for (i = 0; i < max_threads; i++) {
+    pool->workers[i].pool = pool;
+    pool->workers[i].state = SLOT_FREE;
+    pool->workers[i].seed = i + 1;
+  }
+  pthread_mutex_lock(&pool->lock);
+  for (i = 0; i < pool->min_threads; i++) {
+    if (start_worker(pool) != 0) {
       // fprintf(f, "pthread_create failed\n");
     }
   }
+  pthread_mutex_unlock(&pool->lock);
+  pthread_create(&pool->monitor, NULL, monitor_queue, pool);
   return pool;
 }
 
 
+/*
+ * Keep every worker, present and future, on one CPU, so that whatever
+ * the pool's tasks touch stays in that CPU's cache. Returns -1 if the CPU
+ * cannot be used.
+ *
+ */
+int pool_pin(pool_t *pool, int cpu)
+{
+  int i;
+
+  if (cpu < 0 || cpu >= CPU_SETSIZE) {
+    return -1;
+  }
+  pthread_mutex_lock(&pool->lock);
+  pool->cpu = cpu;
+  for (i = 0; i < pool->max_threads; i++) {
+    if (pool->workers[i].state == SLOT_RUNNING) {
+      pin_worker(pool, &pool->workers[i]);
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return 0;
+}
+
 /*
  * Add a task to the threadpool
  *
  */
 int pool_add_task(pool_t *pool, void (*function)(void *), void *argument)
 {
-  pthread_mutex_lock(&pool->lock);
-  while (pool->length >= pool->queue_size) {
+  return pool_add_task_priority(pool, function, argument, 0);
+}
+
+/*
+ * Add a task at a priority level, 0 (lowest) to POOL_PRIORITIES - 1.
+ * Out of range priorities are clamped. Blocks while that level is full.
+ *
+ */
+int pool_add_task_priority(pool_t *pool, void (*function)(void *), void *argument, int priority)
+{
+  pool_task_t task;
+  pool_ring_t *ring;
+  int spins = 0;
+
+  if (priority < 0) priority = 0;
+  if (priority >= POOL_PRIORITIES) priority = POOL_PRIORITIES - 1;
+  ring = &pool->rings[priority];
+  task.function = function;
+  task.argument = argument;
+  task.enqueued = stats_now_us();
+
+  if (push_own_task(pool, &task)) return 0;
+
+  while (!ring_push(ring, &task)) {
+    if (++spins < POOL_SPINS) {
+      cpu_relax();
+      continue;
+    }
+    // announce ourselves before the last try, as park does
+    pthread_mutex_lock(&pool->lock);
+    __atomic_add_fetch(&pool->blocked, 1, __ATOMIC_SEQ_CST);
+    if (ring_push(ring, &task)) {
+      __atomic_sub_fetch(&pool->blocked, 1, __ATOMIC_SEQ_CST);
+      pthread_mutex_unlock(&pool->lock);
+      break;
+    }
     pthread_cond_wait(&pool->removed, &pool->lock);
+    __atomic_sub_fetch(&pool->blocked, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&pool->lock);
+    spins = 0;
   }
-  int pos = (pool->head + pool->length) % pool->queue_size;
-  pool->queue[pos].function = function;
-  pool->queue[pos].argument = argument;
-  pool->length++;
-  pthread_cond_broadcast(&pool->added);
-  // fprintf(f, "added %d to queue, length is now %d\n", *((int*) argument), pool->length);
-  pthread_mutex_unlock(&pool->lock);
+  // fprintf(f, "added %d to queue\n", *((int*) argument));
+  task_added(pool, ring, &task);
   return 0;
 }
 
+/*
+ * Like pool_add_task_priority, but returns -1 at once instead of waiting
+ * if that level is full.
+ *
+ */
+int pool_try_add_task(pool_t *pool, void (*function)(void *), void *argument, int priority)
+{
+  pool_task_t task;
+  pool_ring_t *ring;
+
+  if (priority < 0) priority = 0;
+  if (priority >= POOL_PRIORITIES) priority = POOL_PRIORITIES - 1;
+  ring = &pool->rings[priority];
+  task.function = function;
+  task.argument = argument;
+  task.enqueued = stats_now_us();
 
+  if (push_own_task(pool, &task)) return 0;
+  if (!ring_push(ring, &task)) return -1;
+  task_added(pool, ring, &task);
+  return 0;
+}
 
 /*
- * Destroy the threadpool, free all memory, destroy threads, etc
+ * Tasks waiting in the shared queue.
  *
  */
-int pool_destroy(pool_t *pool)
+long pool_queue_length(pool_t *pool)
 {
+  long length = 0;
   int i;
 
-  pool->stop = 1;
+  for (i = 0; i < POOL_PRIORITIES; i++) {
+    length += ring_length(&pool->rings[i]);
+  }
+  return length;
+}
 
-  for (i = 0; i < pool->num_threads; i++) {
-    pthread_cond_broadcast(&pool->added);
+/*
+ * Milliseconds the oldest task in the shared queue has been waiting.
+ *
+ */
+long pool_queue_delay(pool_t *pool)
+{
+  long now = stats_now_us();
+  long delay = 0;
+  long enqueued;
+  int i;
+
+  for (i = 0; i < POOL_PRIORITIES; i++) {
+    enqueued = ring_head_enqueued(&pool->rings[i]);
+    if (enqueued >= 0 && now - enqueued > delay) delay = now - enqueued;
+  }
+  return delay / 1000;
+}
+
+/*
+ * A worker's own tasks skip the shared queue while its deque has room.
+ *
+ */
+static int push_own_task(pool_t *pool, pool_task_t *task)
+{
+  if ((pool->flags & POOL_WORK_STEALING) && current_worker != NULL &&
+      current_worker->pool == pool && deque_push(current_worker, task)) {
+    wake_one(pool);
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Wake a worker for a task just put on ring, and add one if the queue is
+ * backing up.
+ *
+ */
+static void task_added(pool_t *pool, pool_ring_t *ring, pool_task_t *task)
+{
+  long oldest;
+
+  wake_one(pool);
+  if (__atomic_load_n(&pool->sleepers, __ATOMIC_RELAXED) == 0) {
+    oldest = ring_head_enqueued(ring);
+    if (oldest >= 0) maybe_grow(pool, stats_now_us() - oldest);
   }
+}
+
+
+
+/*
+ * Destroy the threadpool, free all memory, destroy threads, etc
+ *
+ */
+int pool_destroy(pool_t *pool)
+{
+  int i;
 
-  for (i = 0; i < pool->num_threads; i++) {
-    pthread_join(pool->threads[i], NULL);
+  pthread_mutex_lock(&pool->lock);
+  __atomic_store_n(&pool->stop, 1, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&pool->parked);
+  pthread_mutex_unlock(&pool->lock);
+  pthread_join(pool->monitor, NULL);
+
+  // no thread starts once stop is set, so the slots can be read unlocked
+  for (i = 0; i < pool->max_threads; i++) {
+    if (pool->workers[i].state != SLOT_FREE) {
+      pthread_join(pool->workers[i].thread, NULL);
+    }
   }
 
   pthread_mutex_destroy(&pool->lock);
-  pthread_cond_destroy(&pool->added);
+  pthread_cond_destroy(&pool->parked);
   pthread_cond_destroy(&pool->removed);
 
-  free(pool->threads);
-  free(pool->queue);
+  free(pool->workers);
+  for (i = 0; i < POOL_PRIORITIES; i++) {
+    free(pool->rings[i].cells);
+  }
   free(pool);
 
   // fclose(f);
@@ -130,31 +440,506 @@ int pool_destroy(pool_t *pool)
  * Work loop for threads. Should be passed into the pthread_create() method.
  *
  */
-static void* thread_do_work(void* void_pool)
+static void* thread_do_work(void* void_worker)
 {
   // pthread_t tid = pthread_self();
   // fprintf(f, "thread %p starting\n", (void*) tid);
-  pool_t* pool = (pool_t*) void_pool;
-  while (pool->stop == 0) {
-    pthread_mutex_lock(&pool->lock);
-    while (pool->length <= 0) {
-      pthread_cond_wait(&pool->added, &pool->lock);
-      if (pool->stop != 0) {
-        pthread_mutex_unlock(&pool->lock);
-        // fprintf(f, "thread %p finishing\n", (void*) tid);
-        return NULL;
+  worker_t *self = (worker_t*) void_worker;
+  pool_t* pool = self->pool;
+  pool_task_t task;
+  int spins = 0;
+
+  while (!__atomic_load_n(&pool->stop, __ATOMIC_ACQUIRE)) {
+    if (take_task(pool, &task)) {
+      wake_blocked(pool);
+      run_task(pool, &task);
+      spins = 0;
+    } else if (++spins < POOL_SPINS) {
+      cpu_relax();
+    } else if (park(self)) {
+      break;
+    } else {
+      spins = 0;
+    }
+  }
+  // fprintf(f, "thread %p finishing\n", (void*) tid);
+  return NULL;
+}
+
+/*
+ * Work loop for work stealing mode: our own deque first, then the shared
+ * queue, then other workers' deques, and only then sleep.
+ *
+ */
+static void* worker_do_work(void* void_worker)
+{
+  worker_t *self = (worker_t*) void_worker;
+  pool_t *pool = self->pool;
+  pool_task_t task;
+  int spins = 0;
+
+  current_worker = self;
+  while (!__atomic_load_n(&pool->stop, __ATOMIC_ACQUIRE)) {
+    if (deque_pop(self, &task) || take_injected(self, &task) || steal_task(self, &task)) {
+      run_task(pool, &task);
+      spins = 0;
+    } else if (++spins < POOL_SPINS) {
+      cpu_relax();
+    } else if (park(self)) {
+      break;
+    } else {
+      spins = 0;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Grow the pool while the oldest queued task waits, whether or not any
+ * worker is around to notice: they may all be stuck in slow tasks, and
+ * once the queue is too slow admission stops adding tasks too.
+ *
+ */
+static void* monitor_queue(void* void_pool)
+{
+  pool_t *pool = (pool_t*) void_pool;
+  struct timespec tick;
+
+  tick.tv_sec = 0;
+  tick.tv_nsec = POOL_GROW_WAIT_MS * 1000000L;
+  while (!__atomic_load_n(&pool->stop, __ATOMIC_ACQUIRE)) {
+    nanosleep(&tick, NULL);
+    maybe_grow(pool, pool_queue_delay(pool) * 1000L);
+  }
+  return NULL;
+}
+
+/*
+ * Run a task, recording how long it waited and how long it took.
+ *
+ */
+static void run_task(pool_t *pool, pool_task_t *task)
+{
+  long start = stats_now_us();
+
+  stats_record(HIST_QUEUE_WAIT, start - task->enqueued);
+  maybe_grow(pool, start - task->enqueued);
+  task->function(task->argument);
+  stats_record(HIST_SERVICE, stats_now_us() - start);
+  stats_count(STAT_TASKS);
+}
+
+/*
+ * Take the next task off the shared queue: from the level whose oldest
+ * task has the highest priority once aging is added in, the higher level
+ * winning ties. Only the heads need looking at since each level is FIFO.
+ * Returns 0 if every level is empty.
+ *
+ */
+static int take_task(pool_t *pool, pool_task_t *task)
+{
+  long now, score, best_score, enqueued;
+  int i, best;
+
+  while (1) {
+    now = stats_now_us();
+    best_score = -1;
+    best = -1;
+    for (i = POOL_PRIORITIES - 1; i >= 0; i--) {
+      enqueued = ring_head_enqueued(&pool->rings[i]);
+      if (enqueued < 0) continue;
+      score = i + (now - enqueued) / (POOL_AGING_MS * 1000L);
+      if (score > best_score) {
+        best_score = score;
+        best = i;
+      }
+    }
+    if (best < 0) return 0;
+    if (ring_pop(&pool->rings[best], task)) return 1;
+    // somebody took it first; look again
+  }
+}
+
+/*
+ * Take one task from the shared queue to run, and a share of the rest
+ * into our deque where idle workers can steal them.
+ *
+ */
+static int take_injected(worker_t *self, pool_task_t *task)
+{
+  pool_t *pool = self->pool;
+  pool_task_t extra;
+  long waiting = 0;
+  int i, batch, moved;
+
+  if (!take_task(pool, task)) return 0;
+
+  for (i = 0; i < POOL_PRIORITIES; i++) {
+    waiting += ring_length(&pool->rings[i]);
+  }
+  batch = waiting / __atomic_load_n(&pool->num_threads, __ATOMIC_RELAXED);
+  if (batch > DEQUE_BATCH) batch = DEQUE_BATCH;
+  // our deque is empty when we get here, so the batch always fits
+  for (moved = 0; moved < batch && take_task(pool, &extra); moved++) {
+    deque_push(self, &extra);
+  }
+
+  wake_blocked(pool);
+  if (moved > 0) wake_one(pool);
+  return 1;
+}
+
+/*
+ * Try every other worker once, starting from a random one.
+ *
+ */
+static int steal_task(worker_t *self, pool_task_t *task)
+{
+  pool_t *pool = self->pool;
+  int n = pool->max_threads;
+  int i, start, rc, contended;
+
+  do {
+    contended = 0;
+    // xorshift, so each worker walks the others in its own order
+    self->seed ^= self->seed << 13;
+    self->seed ^= self->seed >> 17;
+    self->seed ^= self->seed << 5;
+    start = self->seed % n;
+    for (i = 0; i < n; i++) {
+      worker_t *victim = &pool->workers[(start + i) % n];
+      if (victim == self) continue;
+      rc = deque_steal(victim, task);
+      if (rc == DEQUE_OK) {
+        stats_count(STAT_STEALS);
+        // there may be more where that came from
+        if (__atomic_load_n(&victim->bottom, __ATOMIC_RELAXED) >
+            __atomic_load_n(&victim->top, __ATOMIC_RELAXED)) {
+          wake_one(pool);
+        }
+        return 1;
       }
+      if (rc == DEQUE_ABORT) contended = 1;
+    }
+  } while (contended);
+  return 0;
+}
+
+/*
+ * Sleep until there is work. sleepers goes up before the final look for
+ * work and anyone who makes work visible checks it afterwards (both with
+ * full fences), so either we see the work or they see us and signal.
+ *
+ * Returns 1 if the worker has been idle for POOL_IDLE_MS and should exit
+ * because the pool has more than its standby workers.
+ *
+ */
+static int park(worker_t *self)
+{
+  pool_t *pool = self->pool;
+  struct timespec deadline;
+  int retire = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += POOL_IDLE_MS / 1000;
+  deadline.tv_nsec += (POOL_IDLE_MS % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+
+  pthread_mutex_lock(&pool->lock);
+  __atomic_add_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+  if (!pool->stop && pool_empty(pool)) {
+    stats_count(STAT_PARKS);
+    if (pthread_cond_timedwait(&pool->parked, &pool->lock, &deadline) != 0 &&
+        pool->num_threads > pool->min_threads && !pool->stop) {
+      // our deque is empty, since we only park when there is nothing to do
+      __atomic_sub_fetch(&pool->num_threads, 1, __ATOMIC_RELAXED);
+      self->state = SLOT_EXITED;
+      stats_count(STAT_THREADS_RETIRED);
+      retire = 1;
+    }
+  }
+  __atomic_sub_fetch(&pool->sleepers, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&pool->lock);
+  return retire;
+}
+
+/*
+ * Add a worker if a task has waited too long (waited is in microseconds),
+ * nobody is idle to take the next one and we are below the ceiling.
+ *
+ */
+static void maybe_grow(pool_t *pool, long waited)
+{
+  long now;
+
+  if (waited < POOL_GROW_WAIT_MS * 1000L ||
+      __atomic_load_n(&pool->sleepers, __ATOMIC_RELAXED) > 0 ||
+      __atomic_load_n(&pool->num_threads, __ATOMIC_RELAXED) >= pool->max_threads) {
+    return;
+  }
+  now = stats_now_us();
+  if (now - __atomic_load_n(&pool->last_grow, __ATOMIC_RELAXED) < POOL_GROW_WAIT_MS * 1000L) return;
+
+  pthread_mutex_lock(&pool->lock);
+  if (!pool->stop && pool->num_threads < pool->max_threads &&
+      now - pool->last_grow >= POOL_GROW_WAIT_MS * 1000L) {
+    __atomic_store_n(&pool->last_grow, now, __ATOMIC_RELAXED);
+    start_worker(pool);
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Start a thread in a free slot, reaping the old thread of a slot whose
+ * worker retired. Must hold the lock and be below max_threads.
+ *
+ */
+static int start_worker(pool_t *pool)
+{
+  worker_t *worker = NULL;
+  int i;
+
+  for (i = 0; i < pool->max_threads; i++) {
+    if (pool->workers[i].state != SLOT_RUNNING) {
+      worker = &pool->workers[i];
+      break;
+    }
+  }
+  if (worker->state == SLOT_EXITED) {
+    pthread_join(worker->thread, NULL);
+    worker->state = SLOT_FREE;
+  }
+  if (pthread_create(&worker->thread, NULL,
+                     (pool->flags & POOL_WORK_STEALING) ? worker_do_work : thread_do_work,
+                     worker) != 0) {
+    return -1;
+  }
+  worker->state = SLOT_RUNNING;
+  pin_worker(pool, worker);
+  __atomic_add_fetch(&pool->num_threads, 1, __ATOMIC_RELAXED);
+  stats_count(STAT_THREADS_STARTED);
+  return 0;
+}
+
+// with pool_pin, keep a new worker on the pool's CPU
+static void pin_worker(pool_t *pool, worker_t *worker)
+{
+  cpu_set_t cpus;
+
+  if (pool->cpu < 0) {
+    return;
+  }
+  CPU_ZERO(&cpus);
+  CPU_SET(pool->cpu, &cpus);
+  pthread_setaffinity_np(worker->thread, sizeof(cpus), &cpus);
+}
+
+static int pool_empty(pool_t *pool)
+{
+  int i;
+
+  for (i = 0; i < POOL_PRIORITIES; i++) {
+    if (ring_length(&pool->rings[i]) > 0) return 0;
+  }
+  for (i = 0; (pool->flags & POOL_WORK_STEALING) && i < pool->max_threads; i++) {
+    worker_t *worker = &pool->workers[i];
+    if (__atomic_load_n(&worker->bottom, __ATOMIC_SEQ_CST) >
+        __atomic_load_n(&worker->top, __ATOMIC_SEQ_CST)) {
+      return 0;
     }
-    void (*function)(void*) = pool->queue[pool->head].function;
-    void* argument = pool->queue[pool->head].argument;
-    pool->head = (pool->head + 1) % pool->queue_size;
-    pool->length--;
+  }
+  return 1;
+}
+
+// wake a single parked worker, if there is one
+static void wake_one(pool_t *pool)
+{
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&pool->sleepers, __ATOMIC_SEQ_CST) > 0) {
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_signal(&pool->parked);
+    pthread_mutex_unlock(&pool->lock);
+  }
+}
+
+// wake producers waiting for room, if there are any
+static void wake_blocked(pool_t *pool)
+{
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&pool->blocked, __ATOMIC_SEQ_CST) > 0) {
+    pthread_mutex_lock(&pool->lock);
     pthread_cond_broadcast(&pool->removed);
     pthread_mutex_unlock(&pool->lock);
-    // fprintf(f, "%p: removed %d from queue, length is now %d, processing...\n", (void*) tid, *((int*) argument), pool->length);
-    function(argument);
-    // fprintf(f, "%p finished processing\n", (void*) tid);
   }
-  // fprintf(f, "thread %p finishing\n", (void*) tid);
-  return NULL;
+}
+
+static void ring_init(pool_ring_t *ring, int size)
+{
+  long i, n = 1;
+
+  while (n < size) n <<= 1;
+  ring->cells = (ring_cell_t*) malloc(sizeof(ring_cell_t) * n);
+  for (i = 0; i < n; i++) {
+    ring->cells[i].seq = i;
+  }
+  ring->mask = n - 1;
+  ring->head = 0;
+  ring->tail = 0;
+}
+
+/*
+ * Claim the slot at tail if it is free, fill it, then hand it to
+ * consumers by bumping its seq. Returns 0 if the ring is full.
+ *
+ */
+static int ring_push(pool_ring_t *ring, pool_task_t *task)
+{
+  long pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+  ring_cell_t *cell;
+  long diff;
+
+  while (1) {
+    cell = &ring->cells[pos & ring->mask];
+    diff = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos;
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return 0;
+    } else {
+      pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    }
+  }
+  cell->task.function = task->function;
+  cell->task.argument = task->argument;
+  __atomic_store_n(&cell->task.enqueued, task->enqueued, __ATOMIC_RELAXED);
+  __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+/*
+ * The mirror image of ring_push: claim the slot at head once it has been
+ * filled, then give it back to producers a lap later. Returns 0 if the
+ * ring is empty.
+ *
+ */
+static int ring_pop(pool_ring_t *ring, pool_task_t *task)
+{
+  long pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+  ring_cell_t *cell;
+  long diff;
+
+  while (1) {
+    cell = &ring->cells[pos & ring->mask];
+    diff = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (pos + 1);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return 0;
+    } else {
+      pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    }
+  }
+  task->function = cell->task.function;
+  task->argument = cell->task.argument;
+  task->enqueued = cell->task.enqueued;
+  __atomic_store_n(&cell->seq, pos + ring->mask + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+/*
+ * When the task at the head of the ring was queued, or -1 if the ring is
+ * empty. Only a hint for choosing a level: the task may be gone by the
+ * time it is popped.
+ *
+ */
+static long ring_head_enqueued(pool_ring_t *ring)
+{
+  long pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+  ring_cell_t *cell = &ring->cells[pos & ring->mask];
+
+  if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != pos + 1) return -1;
+  return __atomic_load_n(&cell->task.enqueued, __ATOMIC_RELAXED);
+}
+
+// tasks claimed by producers but not yet by consumers
+static long ring_length(pool_ring_t *ring)
+{
+  long tail = __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+  long head = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+
+  return tail > head ? tail - head : 0;
+}
+
+/*
+ * Chase-Lev deque operations, after Le et al., "Correct and Efficient
+ * Work-Stealing for Weak Memory Models". Only the owner pushes and pops.
+ * Slots are read and written with relaxed atomics since a thief may read
+ * one that the owner is about to reuse; its CAS on top then fails.
+ *
+ */
+static int deque_push(worker_t *worker, pool_task_t *task)
+{
+  long b = __atomic_load_n(&worker->bottom, __ATOMIC_RELAXED);
+  long t = __atomic_load_n(&worker->top, __ATOMIC_ACQUIRE);
+  pool_task_t *slot = &worker->tasks[b & DEQUE_MASK];
+
+  if (b - t >= DEQUE_SIZE) return 0;
+  __atomic_store_n(&slot->function, task->function, __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->argument, task->argument, __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->enqueued, task->enqueued, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&worker->bottom, b + 1, __ATOMIC_RELAXED);
+  return 1;
+}
+
+static int deque_pop(worker_t *worker, pool_task_t *task)
+{
+  long b = __atomic_load_n(&worker->bottom, __ATOMIC_RELAXED) - 1;
+  long t;
+  int found = 1;
+
+  __atomic_store_n(&worker->bottom, b, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  t = __atomic_load_n(&worker->top, __ATOMIC_RELAXED);
+  if (t > b) {
+    __atomic_store_n(&worker->bottom, b + 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+  *task = worker->tasks[b & DEQUE_MASK];
+  if (t == b) {
+    // the last task: race the thieves for it
+    found = __atomic_compare_exchange_n(&worker->top, &t, t + 1, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+    __atomic_store_n(&worker->bottom, b + 1, __ATOMIC_RELAXED);
+  }
+  return found;
+}
+
+static int deque_steal(worker_t *worker, pool_task_t *task)
+{
+  long t = __atomic_load_n(&worker->top, __ATOMIC_ACQUIRE);
+  long b;
+  pool_task_t *slot;
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  b = __atomic_load_n(&worker->bottom, __ATOMIC_ACQUIRE);
+  if (t >= b) return DEQUE_EMPTY;
+  slot = &worker->tasks[t & DEQUE_MASK];
+  task->function = __atomic_load_n(&slot->function, __ATOMIC_RELAXED);
+  task->argument = __atomic_load_n(&slot->argument, __ATOMIC_RELAXED);
+  task->enqueued = __atomic_load_n(&slot->enqueued, __ATOMIC_RELAXED);
+  if (!__atomic_compare_exchange_n(&worker->top, &t, t + 1, 0,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+    return DEQUE_ABORT;
+  }
+  return DEQUE_OK;
 }
@@ -3,10 +3,26 @@
 
 typedef struct pool_t pool_t;
 
-pool_t *pool_create(int thread_count, int queue_size);
+// priority levels for pool_add_task_priority; 0 is the lowest
+#define POOL_PRIORITIES 4
+
+// pool_create flags
+#define POOL_WORK_STEALING 1
+
+pool_t *pool_create(int queue_size, int max_threads, int flags);
+
+int pool_pin(pool_t *pool, int cpu);
 
 int pool_add_task(pool_t *pool, void (*routine)(void *), void *arg);
 
+int pool_add_task_priority(pool_t *pool, void (*routine)(void *), void *arg, int priority);
+
+int pool_try_add_task(pool_t *pool, void (*routine)(void *), void *arg, int priority);
+
+long pool_queue_length(pool_t *pool);
+
+long pool_queue_delay(pool_t *pool);
+
 int pool_destroy(pool_t *pool);
 
 #endif
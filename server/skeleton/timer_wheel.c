@@ -0,0 +1,221 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "timer_wheel.h"
+
+/*
+ * Hierarchical timing wheel. Level 0 has one slot per tick; each slot of
+ * level n covers a whole turn of level n-1. A timer goes into the coarsest
+ * slot that still separates it from "now", and is moved down a level when
+ * the wheel below it comes round (cascading), so adding and cancelling are
+ * O(1) and a tick only looks at the timers that are due.
+ *
+ * With 64 slots a level and four levels, 100ms ticks reach about 19 days;
+ * anything further out is clamped to that.
+ */
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+
+struct timer_wheel_t
+{
+    pthread_mutex_t lock;
+    pthread_t thread;
+    int stop;
+    int tick_ms;
+    unsigned long current;
+    struct timespec start;
+    void (*expire)(wheel_timer_t*, uint64_t);
+    wheel_timer_t slots[WHEEL_LEVELS][WHEEL_SIZE];
+};
+
+static void* run_wheel(void* arg);
+static void advance(timer_wheel_t* wheel);
+static void cascade(timer_wheel_t* wheel, int level);
+static void place(timer_wheel_t* wheel, wheel_timer_t* timer);
+static void unlink_timer(wheel_timer_t* timer);
+
+/*
+ * Create a wheel and the thread that turns it. expire is called for every
+ * timer that comes due, with the wheel locked: it must be quick and must
+ * not call back into the wheel.
+ */
+timer_wheel_t* timer_wheel_create(int tick_ms, void (*expire)(wheel_timer_t*, uint64_t))
+{
+    timer_wheel_t* wheel = (timer_wheel_t*) malloc(sizeof(timer_wheel_t));
+    int level, slot;
+
+    pthread_mutex_init(&wheel->lock, NULL);
+    wheel->stop = 0;
+    wheel->tick_ms = tick_ms;
+    wheel->current = 0;
+    wheel->expire = expire;
+    clock_gettime(CLOCK_MONOTONIC, &wheel->start);
+    for (level = 0; level < WHEEL_LEVELS; level++)
+    {
+        for (slot = 0; slot < WHEEL_SIZE; slot++)
+        {
+            wheel->slots[level][slot].prev = &wheel->slots[level][slot];
+            wheel->slots[level][slot].next = &wheel->slots[level][slot];
+        }
+    }
+
+    if (pthread_create(&wheel->thread, NULL, run_wheel, wheel) != 0)
+    {
+        perror("pthread_create");
+        pthread_mutex_destroy(&wheel->lock);
+        free(wheel);
+        return NULL;
+    }
+    return wheel;
+}
+
+void timer_wheel_init_timer(wheel_timer_t* timer)
+{
+    timer->prev = NULL;
+    timer->next = NULL;
+}
+
+/*
+ * Arm timer to fire in delay_ms, moving it if it was already armed.
+ */
+void timer_wheel_add(timer_wheel_t* wheel, wheel_timer_t* timer, int delay_ms, uint64_t data)
+{
+    pthread_mutex_lock(&wheel->lock);
+    if (timer->next != NULL)
+        unlink_timer(timer);
+    timer->expires = wheel->current + (delay_ms + wheel->tick_ms - 1) / wheel->tick_ms;
+    timer->data = data;
+    place(wheel, timer);
+    pthread_mutex_unlock(&wheel->lock);
+}
+
+void timer_wheel_cancel(timer_wheel_t* wheel, wheel_timer_t* timer)
+{
+    pthread_mutex_lock(&wheel->lock);
+    if (timer->next != NULL)
+        unlink_timer(timer);
+    pthread_mutex_unlock(&wheel->lock);
+}
+
+/*
+ * Stop the wheel's thread. Timers still armed never fire.
+ */
+void timer_wheel_destroy(timer_wheel_t* wheel)
+{
+    pthread_mutex_lock(&wheel->lock);
+    wheel->stop = 1;
+    pthread_mutex_unlock(&wheel->lock);
+    pthread_join(wheel->thread, NULL);
+    pthread_mutex_destroy(&wheel->lock);
+    free(wheel);
+}
+
+/*
+ * Sleep to the next tick boundary and process every tick that has passed,
+ * so a late wakeup catches up instead of drifting.
+ */
+static void* run_wheel(void* arg)
+{
+    timer_wheel_t* wheel = (timer_wheel_t*) arg;
+    struct timespec next, now;
+    unsigned long elapsed;
+
+    pthread_mutex_lock(&wheel->lock);
+    while (!wheel->stop)
+    {
+        elapsed = (wheel->current + 1) * wheel->tick_ms;
+        next.tv_sec = wheel->start.tv_sec + elapsed / 1000;
+        next.tv_nsec = wheel->start.tv_nsec + (elapsed % 1000) * 1000000;
+        if (next.tv_nsec >= 1000000000)
+        {
+            next.tv_sec++;
+            next.tv_nsec -= 1000000000;
+        }
+        pthread_mutex_unlock(&wheel->lock);
+
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed = (now.tv_sec - wheel->start.tv_sec) * 1000
+                + (now.tv_nsec - wheel->start.tv_nsec) / 1000000;
+
+        pthread_mutex_lock(&wheel->lock);
+        while (wheel->current < elapsed / wheel->tick_ms)
+            advance(wheel);
+    }
+    pthread_mutex_unlock(&wheel->lock);
+    return NULL;
+}
+
+// must hold the lock
+static void advance(timer_wheel_t* wheel)
+{
+    unsigned long tick = wheel->current;
+    wheel_timer_t* head = &wheel->slots[0][tick & WHEEL_MASK];
+    wheel_timer_t* timer;
+    int level;
+
+    // when a level comes round, pull the next slot of the one above down
+    for (level = 1; level < WHEEL_LEVELS; level++)
+    {
+        if (((tick >> (WHEEL_BITS * (level - 1))) & WHEEL_MASK) != 0)
+            break;
+        cascade(wheel, level);
+    }
+
+    while ((timer = head->next) != head)
+    {
+        unlink_timer(timer);
+        wheel->expire(timer, timer->data);
+    }
+    wheel->current = tick + 1;
+}
+
+static void cascade(timer_wheel_t* wheel, int level)
+{
+    int slot = (wheel->current >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    wheel_timer_t* head = &wheel->slots[level][slot];
+    wheel_timer_t* timer;
+
+    while ((timer = head->next) != head)
+    {
+        unlink_timer(timer);
+        place(wheel, timer);
+    }
+}
+
+static void place(timer_wheel_t* wheel, wheel_timer_t* timer)
+{
+    unsigned long delta;
+    wheel_timer_t* head;
+    int level;
+
+    if (timer->expires < wheel->current)
+        timer->expires = wheel->current;
+    delta = timer->expires - wheel->current;
+
+    for (level = 0; level < WHEEL_LEVELS - 1; level++)
+    {
+        if (delta < (1UL << (WHEEL_BITS * (level + 1))))
+            break;
+    }
+    if (delta >= (1UL << (WHEEL_BITS * WHEEL_LEVELS)))
+        timer->expires = wheel->current + (1UL << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+
+    head = &wheel->slots[level][(timer->expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void unlink_timer(wheel_timer_t* timer)
+{
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = NULL;
+    timer->next = NULL;
+}
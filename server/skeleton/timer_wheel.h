@@ -0,0 +1,26 @@
+#ifndef _TIMER_WHEEL_H_
+#define _TIMER_WHEEL_H_
+
+#include <stdint.h>
+
+/*
+ * A timer lives inside whatever it times (no allocation per timer). data
+ * is set when the timer is armed and handed back when it fires.
+ */
+typedef struct wheel_timer_t
+{
+    struct wheel_timer_t* prev;
+    struct wheel_timer_t* next;
+    unsigned long expires;
+    uint64_t data;
+} wheel_timer_t;
+
+typedef struct timer_wheel_t timer_wheel_t;
+
+timer_wheel_t* timer_wheel_create(int tick_ms, void (*expire)(wheel_timer_t*, uint64_t));
+void timer_wheel_init_timer(wheel_timer_t* timer);
+void timer_wheel_add(timer_wheel_t* wheel, wheel_timer_t* timer, int delay_ms, uint64_t data);
+void timer_wheel_cancel(timer_wheel_t* wheel, wheel_timer_t* timer);
+void timer_wheel_destroy(timer_wheel_t* wheel);
+
+#endif
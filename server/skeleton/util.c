@@ -1,289 +1,804 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdlib.h>
 #include <signal.h>
 #include <ctype.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <errno.h>
-
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
 
 #include "seats.h"
+#include "util.h"
+#include "conn.h"
+#include "event_loop.h"
+#include "file_cache.h"
+#include "stats.h"
 
 #define BUFSIZE 1024
 
-int writenbytes(int,char *,int);
-int readnbytes(int,char *,int);
-int get_line(int, char*,int);
+int keepalive_timeout = 5;
+int keepalive_max = 100;
+
+int shed_queue_length = 128;
+int shed_queue_delay = 500;
+int retry_after = 1;
 
-int parse_int_arg(char* filename, char* arg);
+static char *notok_body = "<html><body bgColor=white text=black>\n"\
+                          "<h2>404 FILE NOT FOUND</h2>\n"\
+                          "</body></html>\n";
 
-void handle_connection(int* connfd_ptr)
+static char *unavailable_body = "<html><body><h2>SERVICE UNAVAILABLE</h2>"\
+                             "Too many requests, try again shortly.\n</body></html>\n";
+
+static char *bad_request_body = "<html><body><h2>BAD REQUEST</h2>"\
+                                "</body></html>\n";
+
+/*
+ * Content types by file extension; anything else is sent as
+ * application/octet-stream.
+ */
+static struct
 {
-    int connfd = *(connfd_ptr);
-    free(connfd_ptr);
+    char* extension;
+    char* type;
+} content_types[] = {
+    { "html", "text/html" },
+    { "htm",  "text/html" },
+    { "css",  "text/css" },
+    { "js",   "application/javascript" },
+    { "json", "application/json" },
+    { "txt",  "text/plain" },
+    { "png",  "image/png" },
+    { "jpg",  "image/jpeg" },
+    { "jpeg", "image/jpeg" },
+    { "gif",  "image/gif" },
+    { "ico",  "image/x-icon" },
+    { "svg",  "image/svg+xml" },
+};
 
-    int fd;
-    char buf[BUFSIZE+1];
-    char instr[20];
-    char file[100];
-    char type[20];
+/*
+ * Room to build a response in: its headers, a body rendered in place and
+ * the iovecs to send them with. A response is built and sent by one
+ * thread in one go, so there is one of these a thread rather than one a
+ * connection, and a connection waiting for its next request costs no
+ * more than its input buffer.
+ */
+#define RESPONSE_HEADSIZE 512
+#define RESPONSE_OUTSIZE 8192
+#define RESPONSE_IOVECS 4
 
-    int i=0;
-    int j=0;
+typedef struct response_t
+{
+    struct iovec iov[RESPONSE_IOVECS];
+    char head[RESPONSE_HEADSIZE];
+    char out[RESPONSE_OUTSIZE];
+} response_t;
+
+static __thread response_t response;
+
+/*
+ * What the seat endpoints take from the query string: seat= (a single
+ * seat, or a group as a comma separated list), user=, venue= and
+ * priority=.
+ */
+typedef struct seat_args_t
+{
+    int seat_ids[SEAT_BATCH_MAX];
+    int seat_batch;
+    int seat_id;
+    int user_id;
+    int venue;
+    int priority;
+} seat_args_t;
 
-    char *ok_response = "HTTP/1.0 200 OK\r\n"\
-                           "Content-type: text/html\r\n\r\n";
+/*
+ * Endpoints by exact path; anything else is served as a file. endpoint
+ * is the latency histogram to record in, -1 for none. A new endpoint
+ * only needs an entry here: at first use the routes are placed in
+ * route_slots by a seed for which their hashes do not collide, so a
+ * lookup is one hash and one compare.
+ */
+typedef struct route_t
+{
+    char* path;
+    void (*handler)(conn_t* conn, seat_args_t* args, int keep_alive);
+    int endpoint;
+} route_t;
 
-    char *notok_response = "HTTP/1.0 404 FILE NOT FOUND\r\n"\
-                            "Content-type: text/html\r\n\r\n"\
-                            "<html><body bgColor=white text=black>\n"\
-                            "<h2>404 FILE NOT FOUND</h2>\n"\
-                            "</body></html>\n";
+static void serve_list_seats(conn_t* conn, seat_args_t* args, int keep_alive);
+static void serve_view_seat(conn_t* conn, seat_args_t* args, int keep_alive);
+static void serve_confirm(conn_t* conn, seat_args_t* args, int keep_alive);
+static void serve_cancel(conn_t* conn, seat_args_t* args, int keep_alive);
+static void serve_stats(conn_t* conn, seat_args_t* args, int keep_alive);
 
-    char *bad_request = "HTTP/1.0 400 BAD REQUEST\r\n"\
-                              "Content-type: text/html\r\n\r\n"\
-                              "<html><body><h2>BAD REQUEST</h2>"\
-                              "</body></html>\n";
-                              
+static route_t routes[] = {
+    { "list_seats", serve_list_seats, HIST_LIST_SEATS },
+    { "view_seat",  serve_view_seat,  HIST_VIEW_SEAT },
+    { "confirm",    serve_confirm,    HIST_CONFIRM },
+    { "cancel",     serve_cancel,     HIST_CANCEL },
+    { "stats",      serve_stats,      -1 },
+};
 
-    // first read loop -- get request and headers
+#define ROUTE_SLOTS 16
+#define ROUTE_MAX_SEEDS 100000
 
-    // parse request to get file name
-    // Assumption: this is a GET request and filename contains no spaces
-    // parse request
-    // get headers
-
-    //Expection Format: 'GET filenane.txt HTTP/1.X'
-    
-    get_line(connfd, buf, BUFSIZE);
-    
-    //parse out instruction
-    while( !isspace(buf[j]) && (i < sizeof(instr) - 1))
+static route_t* route_slots[ROUTE_SLOTS];
+static uint32_t route_seed;
+static pthread_once_t routes_once = PTHREAD_ONCE_INIT;
+
+int writenbytes(int,char *,int);
+int writevnbytes(int, struct iovec*, int);
+
+
+static int serve_buffered(conn_t* conn);
+static void serve_request(conn_t* conn, int keep_alive);
+static void send_reply(conn_t* conn, int keep_alive);
+static route_t* find_route(char* path);
+static void place_routes();
+static uint32_t route_hash(char* path, uint32_t seed);
+static void send_response(conn_t* conn, char* status, char* type, char* body, int length, int keep_alive);
+static void send_head_body(conn_t* conn, int n, char* body, int length);
+static int send_file_headers(conn_t* conn, char* type, long content_length, int keep_alive);
+static char* connection_header(int keep_alive);
+static void send_cached(conn_t* conn, cache_entry_t* entry, int keep_alive);
+static void send_listing(conn_t* conn, query_t* query, int venue, int keep_alive);
+static char* content_type(char* path);
+static int send_file(int connfd, int fd, off_t size);
+static int splice_file(int connfd, int fd, off_t offset, off_t size);
+static int copy_file(int connfd, int fd, off_t offset, off_t size);
+static int wait_writable(int fd);
+static int request_keep_alive(request_t* req);
+
+void handle_connection(void* arg)
+{
+    conn_t* conn = (conn_t*) arg;
+    struct timeval timeout;
+
+    // a client that never finishes its request, or never reads the
+    // answer, gives the worker back after the timeout; keep-alive itself
+    // is only offered with -e
+    timeout.tv_sec = keepalive_timeout;
+    timeout.tv_usec = 0;
+    setsockopt(conn->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(conn->fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    while (serve_buffered(conn) && conn_fill(conn) > 0)
     {
-        instr[i] = buf[i];
-        i++;
-        j++;
     }
-    j+=2;
-    instr[i] = '\0';
+    close(conn->fd);
+    conn_free(conn);
+}
 
+/*
+ * Serve the requests the event loop has buffered for a connection. The
+ * connection goes back to the loop if it is to be kept alive.
+ */
+void handle_buffered_connection(void* arg)
+{
+    conn_t* conn = (conn_t*) arg;
 
-    //Only accept GET requests
-    if (strncmp(instr, "GET", 3) != 0) {
-        writenbytes(connfd, bad_request, strlen(bad_request));
-        close(connfd);
-        return;
+    if (serve_buffered(conn))
+        event_loop_rearm(conn);
+    else
+        event_loop_release(conn);
+}
+
+/*
+ * Answer every complete request in the connection buffer, in order, so
+ * pipelined requests are served without waiting on the socket. Returns 0
+ * once the connection should be closed.
+ */
+static int serve_buffered(conn_t* conn)
+{
+    int keep_alive;
+    int rc;
+
+    while ((rc = conn_parse(conn, &conn->req)) > 0)
+    {
+        conn->requests++;
+        keep_alive = request_keep_alive(&conn->req) && conn->requests < keepalive_max;
+        serve_request(conn, keep_alive);
+        conn_consume(conn, &conn->req);
+        if (!keep_alive)
+            return 0;
     }
 
-    //parse out filename
-    i=0;
-    while (!isspace(buf[j]) && (i < sizeof(file) - 1))
+    // the buffer filled up without holding a whole request
+    if (rc < 0)
+    {
+        send_response(conn, "400 BAD REQUEST", "text/html", bad_request_body, strlen(bad_request_body), 0);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * HTTP/1.1 connections persist unless the client asks otherwise; HTTP/1.0
+ * ones only when the client asks for it.
+ */
+static int request_keep_alive(request_t* req)
+{
+    if (req->connection != -1)
+        return req->connection;
+    return slice_equals(req->version, "HTTP/1.1");
+}
+
+/*
+ * Write the status line, Content-type and Content-Length into buf. The
+ * Connection header and blank line are left to the caller since they
+ * depend on the request.
+ */
+int render_headers(char* buf, int size, char* status, char* type, long content_length)
+{
+    return snprintf(buf, size,
+            "HTTP/1.1 %s\r\n"\
+            "Content-type: %s\r\n"\
+            "Content-Length: %ld\r\n",
+            status, type, content_length);
+}
+
+/*
+ * Admission control: queue a task on the pool unless the queue is already
+ * too long or its oldest task has waited too long, so that the requests we
+ * do take are served in bounded time. Returns -1 if the task was turned
+ * away, in which case the caller should answer with send_unavailable.
+ */
+int admit_task(pool_t* pool, void (*function)(void*), void* argument, int priority)
+{
+    if (pool_queue_length(pool) < shed_queue_length && pool_queue_delay(pool) < shed_queue_delay &&
+            pool_try_add_task(pool, function, argument, priority) == 0)
+        return 0;
+    stats_count(STAT_SHED);
+    return -1;
+}
+
+/*
+ * 503 with a hint of when to come back. The connection is not kept: the
+ * caller closes it. This runs on the thread accepting or reading
+ * connections, so it makes one attempt that cannot block; whatever does
+ * not fit in the socket buffer is lost with the connection.
+ */
+void send_unavailable(conn_t* conn)
+{
+    struct msghdr msg;
+    int n = render_headers(response.head, RESPONSE_HEADSIZE, "503 Service Unavailable", "text/html",
+            strlen(unavailable_body));
+    n += snprintf(response.head + n, RESPONSE_HEADSIZE - n, "Retry-After: %d\r\n%s",
+            retry_after, connection_header(0));
+
+    response.iov[0].iov_base = response.head;
+    response.iov[0].iov_len = n;
+    response.iov[1].iov_base = unavailable_body;
+    response.iov[1].iov_len = strlen(unavailable_body);
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = response.iov;
+    msg.msg_iovlen = 2;
+    sendmsg(conn->fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+static char* connection_header(int keep_alive)
+{
+    return keep_alive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+}
+
+/*
+ * A whole response in one writev, so that the headers and a small body
+ * leave in the same segment instead of the body waiting on the client's
+ * delayed ACK of the headers.
+ */
+static void send_response(conn_t* conn, char* status, char* type, char* body, int length, int keep_alive)
+{
+    int n = render_headers(response.head, RESPONSE_HEADSIZE, status, type, length);
+    n += snprintf(response.head + n, RESPONSE_HEADSIZE - n, "%s", connection_header(keep_alive));
+    send_head_body(conn, n, body, length);
+}
+
+// the n bytes of headers in response.head, then the body
+static void send_head_body(conn_t* conn, int n, char* body, int length)
+{
+    struct iovec* iov = response.iov;
+
+    iov[0].iov_base = response.head;
+    iov[0].iov_len = n;
+    iov[1].iov_base = body;
+    iov[1].iov_len = length;
+    if (writevnbytes(conn->fd, iov, length > 0 ? 2 : 1) < 0)
+        shutdown(conn->fd, SHUT_RDWR);
+}
+
+/*
+ * Headers for a body that follows from a file. MSG_MORE holds them back
+ * until the first of the file is sent with them; an empty file has nothing
+ * to follow, so its headers go at once.
+ */
+static int send_file_headers(conn_t* conn, char* type, long content_length, int keep_alive)
+{
+    int n = render_headers(response.head, RESPONSE_HEADSIZE, "200 OK", type, content_length);
+    int flags = content_length > 0 ? MSG_MORE | MSG_NOSIGNAL : MSG_NOSIGNAL;
+    int rc, sent = 0;
+
+    n += snprintf(response.head + n, RESPONSE_HEADSIZE - n, "%s", connection_header(keep_alive));
+    while (sent < n)
     {
-        file[i] = buf[j];
-        i++;
-        j++;
+        rc = send(conn->fd, response.head + sent, n - sent, flags);
+        if (rc > 0)
+            sent += rc;
+        else if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            if (wait_writable(conn->fd) < 0)
+                return -1;
+        }
+        else if (rc < 0 && errno != EINTR)
+            return -1;
     }
-    j++;
-    file[i] = '\0';
+    return 0;
+}
+
+/*
+ * A cached file goes out in a single writev: the pre-rendered headers, the
+ * Connection header and the contents.
+ */
+static void send_cached(conn_t* conn, cache_entry_t* entry, int keep_alive)
+{
+    struct iovec* iov = response.iov;
+    char* connection = connection_header(keep_alive);
+
+    iov[0].iov_base = entry->header;
+    iov[0].iov_len = entry->header_len;
+    iov[1].iov_base = connection;
+    iov[1].iov_len = strlen(connection);
+    iov[2].iov_base = entry->data;
+    iov[2].iov_len = entry->size;
+    if (writevnbytes(conn->fd, iov, 3) < 0)
+        shutdown(conn->fd, SHUT_RDWR);
+}
 
-    //parse out type
-    i=0;
-    while (!isspace(buf[j]) && (buf[j] != '\0') && (i < sizeof(type) - 1))
+/*
+ * The seat listing goes out straight from the seat store's buffer, tagged
+ * with its version so that a poller which already has it gets a 304.
+ * format=packed asks for two bits a seat and format=rle for runs; the tag
+ * says which, since the versions are shared.
+ */
+static void send_listing(conn_t* conn, query_t* query, int venue, int keep_alive)
+{
+    char* header = response.head;
+    char etag[32];
+    unsigned long version;
+    char* listing;
+    char* rle = NULL;
+    char kind = 't';
+    int length, n, size;
+
+    if (query_equals(query, "format", "packed"))
     {
-        type[i] = buf[j];
-        i++;
-        j++;
+        kind = 'p';
+        length = list_seats_packed(venue, &listing, &version);
+    }
+    else if (query_equals(query, "format", "rle"))
+    {
+        // runs are rendered per request, in the response buffer unless
+        // the venue is too big and too fragmented for it
+        kind = 'r';
+        listing = response.out;
+        size = RESPONSE_OUTSIZE;
+        while ((length = list_seats_rle(venue, listing, size, &version)) >= size)
+        {
+            free(rle);
+            size = length + 1;
+            listing = rle = (char*) malloc(size);
+        }
+    }
+    else
+    {
+        length = list_seats(venue, &listing, &version);
     }
-    type[i] = '\0';
 
-    while (get_line(connfd, buf, BUFSIZE) > 0)
+    if (length < 0)
     {
-        //ignore headers -> (for now)
+        n = snprintf(response.out, RESPONSE_OUTSIZE, "Requested venue not found\n\n");
+        send_response(conn, "404 NOT FOUND", "text/html", response.out, n, keep_alive);
+        return;
     }
 
-    int length;
-    for(i = 0; i < strlen(file); i++)
+    snprintf(etag, sizeof(etag), "\"%c%lu\"", kind, version);
+    if (slice_equals(conn->req.if_none_match, etag))
     {
-        if(file[i] == '?')
-            break;
+        n = snprintf(header, RESPONSE_HEADSIZE, "HTTP/1.1 304 Not Modified\r\nETag: %s\r\n%s",
+                etag, connection_header(keep_alive));
+        send_head_body(conn, n, NULL, 0);
+        free(rle);
+        return;
+    }
+
+    n = render_headers(header, RESPONSE_HEADSIZE, "200 OK", kind == 't' ? "text/html" : "text/plain", length);
+    n += snprintf(header + n, RESPONSE_HEADSIZE - n, "ETag: %s\r\n%s", etag, connection_header(keep_alive));
+    send_head_body(conn, n, listing, length);
+    free(rle);
+}
+
+static void serve_request(conn_t* conn, int keep_alive)
+{
+    request_t* req = &conn->req;
+    int connfd = conn->fd;
+    int fd;
+    query_t* query = &req->query;
+    char* resource;
+    route_t* route;
+    seat_args_t args;
+    long start = stats_now_us();
+
+    // Assumption: this is a GET request and filename contains no spaces
+
+    //Only accept GET requests
+    if (!slice_equals(req->method, "GET")) {
+        send_response(conn, "400 BAD REQUEST", "text/html", bad_request_body, strlen(bad_request_body), keep_alive);
+        return;
     }
-    length = i;
-    
-    char resource[length+1];
 
-    if (length > strlen(file)) {
-      length = strlen(file);
+    // the target was split into path and parameters when it was parsed;
+    // the path is decoded where it lies, since the request is not looked
+    // at again. A missing number counts as 0, a malformed one, a group
+    // larger than we take or more parameters than we keep is refused
+    // outright
+    args.seat_id = args.user_id = args.venue = args.priority = 0;
+    args.seat_batch = query_int_list(query, "seat", args.seat_ids, SEAT_BATCH_MAX);
+    if (query->overflow || query_decode_path(query) < 0 || args.seat_batch < 0 || args.seat_batch > SEAT_BATCH_MAX ||
+        query_int(query, "user", &args.user_id) < 0 || query_int(query, "venue", &args.venue) < 0 ||
+        query_int(query, "priority", &args.priority) < 0)
+    {
+        send_response(conn, "400 BAD REQUEST", "text/html", bad_request_body, strlen(bad_request_body), keep_alive);
+        return;
     }
+    if (args.seat_batch > 0)
+        args.seat_id = args.seat_ids[0];
+    resource = query->path.ptr;
+    if (*resource == '/')
+        resource++;
+
+    stats_count(STAT_REQUESTS);
 
-    strncpy(resource, file, length);
-    resource[length] = 0;
-    
-    int seat_id = parse_int_arg(file, "seat=");
-    int user_id = parse_int_arg(file, "user=");
-    int customer_priority = parse_int_arg(file, "priority=");
-    
     // Check if the request is for one of our operations
-    if (strncmp(resource, "list_seats", length) == 0)
-    {  
-        list_seats(buf, BUFSIZE);
-        // send headers
-        writenbytes(connfd, ok_response, strlen(ok_response));
-        // send data
-        writenbytes(connfd, buf, strlen(buf));
+    if ((route = find_route(resource)) != NULL)
+    {
+        route->handler(conn, &args, keep_alive);
+        if (route->endpoint >= 0)
+            stats_record(route->endpoint, stats_now_us() - start);
+        return;
+    }
+
+    // anything else is a file
+    struct stat st;
+    cache_entry_t* entry;
+
+    // hot files are answered from memory
+    if ((entry = file_cache_get(resource, content_type(resource))) != NULL)
+    {
+        send_cached(conn, entry, keep_alive);
+        file_cache_release(entry);
+    }
+    // try to open the file
+    else if ((fd = open(resource, O_RDONLY)) == -1 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+    {
+        if (fd != -1)
+            close(fd);
+        send_response(conn, "404 FILE NOT FOUND", "text/html", notok_body, strlen(notok_body), keep_alive);
     } 
-    else if(strncmp(resource, "view_seat", length) == 0)
+    else
     {
-        view_seat(buf, BUFSIZE, seat_id, user_id, customer_priority);
-        // send headers
-        writenbytes(connfd, ok_response, strlen(ok_response));
-        // send data
-        writenbytes(connfd, buf, strlen(buf));
+        // send headers, then the file; a short one leaves the client
+        // unable to find the next response, so the connection has to go
+        if (send_file_headers(conn, content_type(resource), st.st_size, keep_alive) != 0 ||
+                send_file(connfd, fd, st.st_size) != 0)
+            shutdown(connfd, SHUT_RDWR);
+        // close file and free space
+        close(fd);
     } 
-    else if(strncmp(resource, "confirm", length) == 0)
+    stats_record(HIST_STATIC, stats_now_us() - start);
+}
+
+static void serve_list_seats(conn_t* conn, seat_args_t* args, int keep_alive)
+{
+    send_listing(conn, &conn->req.query, args->venue, keep_alive);
+}
+
+static void serve_view_seat(conn_t* conn, seat_args_t* args, int keep_alive)
+{
+    if (args->seat_batch > 1)
+        view_seats(response.out, RESPONSE_OUTSIZE, args->venue, args->seat_ids, args->seat_batch, args->user_id, args->priority);
+    else
+        view_seat(response.out, RESPONSE_OUTSIZE, args->venue, args->seat_id, args->user_id, args->priority);
+    send_reply(conn, keep_alive);
+}
+
+static void serve_confirm(conn_t* conn, seat_args_t* args, int keep_alive)
+{
+    if (args->seat_batch > 1)
+        confirm_seats(response.out, RESPONSE_OUTSIZE, args->venue, args->seat_ids, args->seat_batch, args->user_id, args->priority);
+    else
+        confirm_seat(response.out, RESPONSE_OUTSIZE, args->venue, args->seat_id, args->user_id, args->priority);
+    send_reply(conn, keep_alive);
+}
+
+static void serve_cancel(conn_t* conn, seat_args_t* args, int keep_alive)
+{
+    if (args->seat_batch > 1)
+        cancel_seats(response.out, RESPONSE_OUTSIZE, args->venue, args->seat_ids, args->seat_batch, args->user_id, args->priority);
+    else
+        cancel(response.out, RESPONSE_OUTSIZE, args->venue, args->seat_id, args->user_id, args->priority);
+    send_reply(conn, keep_alive);
+}
+
+// stats?format=json for machines, plain text otherwise
+static void serve_stats(conn_t* conn, seat_args_t* args, int keep_alive)
+{
+    int json = query_equals(&conn->req.query, "format", "json");
+    int n = stats_render(response.out, RESPONSE_OUTSIZE, json);
+    send_response(conn, "200 OK", json ? "application/json" : "text/plain", response.out, n, keep_alive);
+}
+
+// the text a seat operation left in the response buffer
+static void send_reply(conn_t* conn, int keep_alive)
+{
+    send_response(conn, "200 OK", "text/html", response.out, strlen(response.out), keep_alive);
+}
+
+/*
+ * The route for an exact path, or NULL: one hash and one compare.
+ */
+static route_t* find_route(char* path)
+{
+    route_t* route;
+
+    pthread_once(&routes_once, place_routes);
+    route = route_slots[route_hash(path, route_seed) & (ROUTE_SLOTS - 1)];
+    return (route != NULL && strcmp(route->path, path) == 0) ? route : NULL;
+}
+
+/*
+ * Find a seed for which every route hashes to a slot of its own, making
+ * the hash perfect for this table. With the table kept at least three
+ * times the number of routes, a few tries are enough.
+ */
+static void place_routes()
+{
+    int i, slot, count = sizeof(routes) / sizeof(routes[0]);
+
+    for (route_seed = 1; route_seed < ROUTE_MAX_SEEDS; route_seed++)
     {
-        confirm_seat(buf, BUFSIZE, seat_id, user_id, customer_priority);
-        // send headers
-        writenbytes(connfd, ok_response, strlen(ok_response));
-        // send data
-        writenbytes(connfd, buf, strlen(buf));
+        memset(route_slots, 0, sizeof(route_slots));
+        for (i = 0; i < count; i++)
+        {
+            slot = route_hash(routes[i].path, route_seed) & (ROUTE_SLOTS - 1);
+            if (route_slots[slot] != NULL)
+                break;
+            route_slots[slot] = &routes[i];
+        }
+        if (i == count)
+            return;
     }
-    else if(strncmp(resource, "cancel", length) == 0)
+    fprintf(stderr, "no perfect hash for %d routes in %d slots\n", count, ROUTE_SLOTS);
+    exit(-1);
+}
+
+// FNV-1a, started from the seed
+static uint32_t route_hash(char* path, uint32_t seed)
+{
+    uint32_t h = 2166136261u ^ seed;
+
+    while (*path != '\0')
+        h = (h ^ (unsigned char) *path++) * 16777619u;
+    return h;
+}
+
+static char* content_type(char* path)
+{
+    char* dot = strrchr(path, '.');
+    int i;
+
+    if (dot != NULL && strchr(dot, '/') == NULL)
     {
-        cancel(buf, BUFSIZE, seat_id, user_id, customer_priority);
-        // send headers
-        writenbytes(connfd, ok_response, strlen(ok_response));
-        // send data
-        writenbytes(connfd, buf, strlen(buf));
+        for (i = 0; i < sizeof(content_types) / sizeof(content_types[0]); i++)
+        {
+            if (strcasecmp(dot + 1, content_types[i].extension) == 0)
+                return content_types[i].type;
+        }
     }
-    else
+    return "application/octet-stream";
+}
+
+/*
+ * Stream size bytes of fd to the socket without passing them through user
+ * space. sendfile does it in one call where the kernel supports the pair
+ * of descriptors; otherwise we splice through a pipe.
+ */
+static int send_file(int connfd, int fd, off_t size)
+{
+    off_t offset = 0;
+    ssize_t rc;
+
+    while (offset < size)
     {
-        // try to open the file
-        if ((fd = open(resource, O_RDONLY)) == -1)
-        {
-            writenbytes(connfd, notok_response, strlen(notok_response));
-        } 
-        else
+        rc = sendfile(connfd, fd, &offset, size - offset);
+        if (rc > 0)
+            continue;
+        if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
         {
-            // send headers
-            writenbytes(connfd, ok_response, strlen(ok_response));
-            // send file
-            int ret;
-            while ( (ret = read(fd, buf, BUFSIZE)) > 0) {
-                writenbytes(connfd, buf, ret);
-            }  
-            // close file and free space
-            close(fd);
-        } 
+            if (wait_writable(connfd) < 0)
+                return -1;
+        }
+        else if (rc < 0 && (errno == EINVAL || errno == ENOSYS) && offset == 0)
+            return splice_file(connfd, fd, offset, size);
+        else if (rc == 0 || errno != EINTR)
+            return -1;
     }
-    close(connfd);
+    return 0;
 }
 
-int get_line(int fd, char *buf, int size)
+static int splice_file(int connfd, int fd, off_t offset, off_t size)
 {
+    int pipefd[2];
+    ssize_t rc, pending;
 
-    int i=0;
-    char c = '\0';
-    int n;
+    if (pipe(pipefd) != 0)
+        return copy_file(connfd, fd, offset, size);
 
-    while((i < size-1) && (c != '\n'))
+    while (offset < size)
     {
-        n = readnbytes(fd, &c, 1);
-        if (n > 0)
+        rc = splice(fd, &offset, pipefd[1], NULL, size - offset, SPLICE_F_MOVE);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc < 0 && errno == EINVAL && offset == 0)
         {
-            if (c == '\r')
+            close(pipefd[0]);
+            close(pipefd[1]);
+            return copy_file(connfd, fd, offset, size);
+        }
+        if (rc <= 0)
+            break;
+
+        // drain the pipe into the socket before filling it again; only
+        // the last of the file is pushed out at once
+        pending = rc;
+        while (pending > 0)
+        {
+            rc = splice(pipefd[0], NULL, connfd, NULL, pending,
+                    offset < size ? SPLICE_F_MOVE | SPLICE_F_MORE : SPLICE_F_MOVE);
+            if (rc > 0)
+                pending -= rc;
+            else if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
             {
-                n = readnbytes(fd, &c, 1);
-
-                if ((n > 0) && (c == '\n'))
-                {
-                    //this is an \r\n endline for request
-                    //we want to then return the line
-                    //readnbytes(fd, &c, 1);
-                    continue;
-                } 
-                else 
-                {
-                    c = '\n';
-                }
+                if (wait_writable(connfd) < 0)
+                    break;
             }
-            buf[i] = c;
-            i++;
-        } 
-        else
-        {
-            c = '\n';
+            else if (rc == 0 || errno != EINTR)
+                break;
         }
+        if (pending > 0)
+            break;
     }
-    buf[i] = '\0';
-    return i;
+
+    close(pipefd[0]);
+    close(pipefd[1]);
+    return offset < size ? -1 : 0;
 }
 
-int readnbytes(int fd,char *buf,int size)
+// last resort for files neither sendfile nor splice can read
+static int copy_file(int connfd, int fd, off_t offset, off_t size)
 {
-    int rc = 0;
-    int totalread = 0;
-    while ((rc = read(fd,buf+totalread,size-totalread)) > 0)
-        totalread += rc;
+    char buf[BUFSIZE];
+    ssize_t rc;
 
-    if (rc < 0)
+    while (offset < size && (rc = pread(fd, buf, BUFSIZE, offset)) > 0)
     {
-        return -1;
+        if (writenbytes(connfd, buf, rc) < 0)
+            return -1;
+        offset += rc;
     }
-    else
-        return totalread;
+    return offset < size ? -1 : 0;
+}
+
+/*
+ * Sockets from the event loop are non-blocking, and blocking ones give up
+ * after the send timeout. Either way a client that stops reading gets as
+ * long as an idle one to make room; returns -1 once it has had that, and
+ * the caller drops the connection.
+ */
+static int wait_writable(int fd)
+{
+    struct pollfd pfd;
+    int rc;
+
+    pfd.fd = fd;
+    pfd.events = POLLOUT;
+    while ((rc = poll(&pfd, 1, keepalive_timeout * 1000)) < 0 && errno == EINTR)
+    {
+    }
+    return rc > 0 && !(pfd.revents & (POLLERR | POLLNVAL)) ? 0 : -1;
 }
 
 int writenbytes(int fd,char *str,int size)
 {
     int rc = 0;
     int totalwritten =0;
-    while ((rc = write(fd,str+totalwritten,size-totalwritten)) > 0)
-        totalwritten += rc;
 
-    if (rc < 0)
-        return -1;
-    else
-        return totalwritten;
+    while (totalwritten < size)
+    {
+        rc = write(fd,str+totalwritten,size-totalwritten);
+        if (rc > 0)
+        {
+            totalwritten += rc;
+        }
+        else if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            if (wait_writable(fd) < 0)
+                return -1;
+        }
+        else if (rc < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        else
+        {
+            return -1;
+        }
+    }
+    return totalwritten;
 }
 
-int parse_int_arg(char* filename, char* arg)
+/*
+ * writev until every byte of the iovec array is out. The array is updated
+ * in place as parts of it are written.
+ */
+int writevnbytes(int fd, struct iovec* iov, int iovcnt)
 {
-    int i;
-    bool found_value_start = false;
-    bool found_arg_list_start = false;
-    int seatnum = 0;
-    for(i=0; i < strlen(filename); i++)
+    int rc = 0;
+    int totalwritten = 0;
+
+    while (iovcnt > 0)
     {
-        if (!found_arg_list_start)
+        rc = writev(fd, iov, iovcnt);
+        if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
         {
-            if (filename[i] == '?')
-            {
-                found_arg_list_start = true;
-            }
+            if (wait_writable(fd) < 0)
+                return -1;
             continue;
         }
-        if (!found_value_start && strncmp(&filename[i], arg, strlen(arg)) == 0)
+        else if (rc < 0 && errno == EINTR)
         {
-            found_value_start = true;
-            i += strlen(arg);
+            continue;
         }
-        if (found_value_start)
+        else if (rc <= 0)
         {
-            if(isdigit(filename[i]))
-            {
-                seatnum = seatnum * 10 + (int) filename[i] - (int) '0';
-                continue;
-            } 
-            else
-            {
-                break;
-            }
+            return -1;
+        }
+
+        totalwritten += rc;
+        while (iovcnt > 0 && rc >= iov->iov_len)
+        {
+            rc -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char*) iov->iov_base + rc;
+            iov->iov_len -= rc;
         }
     }
-    return seatnum;
+    return totalwritten;
 }
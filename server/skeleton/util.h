@@ -1,6 +1,23 @@
 #ifndef _UTIL_H_
 #define _UTIL_H_
 
+#include "thread_pool.h"
+#include "conn.h"
+
+// idle timeout in seconds and request limit for persistent connections
+extern int keepalive_timeout;
+extern int keepalive_max;
+
+// queue length, queueing delay in ms and Retry-After seconds for load shedding
+extern int shed_queue_length;
+extern int shed_queue_delay;
+extern int retry_after;
+
 void handle_connection(void*);
+void handle_buffered_connection(void*);
+
+int admit_task(pool_t* pool, void (*function)(void*), void* argument, int priority);
+void send_unavailable(conn_t* conn);
+int render_headers(char* buf, int size, char* status, char* type, long content_length);
 
 #endif